@@ -38,7 +38,8 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
         return NULL;
     }
 
-    while (char_offset > (buffer->entry[fake_output_offset].size - 1)) {
+    /* >= rather than > size - 1, which wraps around for an empty entry */
+    while (char_offset >= buffer->entry[fake_output_offset].size) {
         char_offset -= buffer->entry[fake_output_offset].size;
         fake_output_offset++;
         if (fake_output_offset == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
@@ -60,7 +61,7 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
  * and advances buffer->out_offs to the new start location. Any necessary
  * locking must be handled by the caller Any memory referenced in @param
  * add_entry must be allocated by and/or must have a lifetime managed by the
- * caller.
+ * caller; in the kernel, the buffer kfree()s the entry it overwrites.
  */
 void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
                                     const struct aesd_buffer_entry *add_entry) {
@@ -74,9 +75,12 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
             buffer->out_offs = 0;
         }
     }
+#ifdef __KERNEL__
+    /* The driver hands its kmalloc()ed writes over to the buffer */
     if (buffer->entry[buffer->in_offs].buffptr) {
         kfree(buffer->entry[buffer->in_offs].buffptr);
     }
+#endif
     buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
     buffer->entry[buffer->in_offs].size = add_entry->size;
 
@@ -33,14 +33,57 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Entries matched by AESDCHAR_IOCFILTER: those containing the pattern, or
+ * those starting with it
+ */
+#define AESD_FILTER_SUBSTRING 0
+#define AESD_FILTER_PREFIX 1
+#define AESD_FILTER_MAX_PATTERN 4096
+
+/**
+ * A structure passed by IOCTL to copy only the entries matching a pattern,
+ * oldest first, instead of reading the whole device
+ */
+struct aesd_filter {
+    /**
+     * AESD_FILTER_SUBSTRING or AESD_FILTER_PREFIX
+     */
+    uint32_t mode;
+    /**
+     * Length of the pattern, at most AESD_FILTER_MAX_PATTERN; 0 matches every entry
+     */
+    uint32_t pattern_len;
+    /**
+     * User space address of the pattern, which may hold any bytes
+     */
+    uint64_t pattern;
+    /**
+     * User space address and size of the buffer receiving the matching entries
+     */
+    uint64_t buf;
+    uint32_t buf_len;
+    /**
+     * Set by the driver: bytes copied to buf, whole entries only, and bytes
+     * all matching entries take, more than copied if buf_len was too small
+     */
+    uint32_t copied;
+    uint32_t needed;
+    /**
+     * Set by the driver: number of matching entries
+     */
+    uint32_t matches;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+#define AESDCHAR_IOCFILTER _IOWR(AESD_IOC_MAGIC, 2, struct aesd_filter)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 2
 
 #endif /* AESD_IOCTL_H */
@@ -32,6 +32,19 @@
 #define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/*
+ * Running totals for the compress module option, shown in /proc/aesdchar.
+ */
+struct aesd_compress_stats {
+    u64 entries_compressed;
+    u64 entries_stored_raw;
+    u64 bytes_in;
+    u64 bytes_out;
+    u64 compress_ns;
+    u64 decompressions;
+    u64 decompress_ns;
+};
+
 struct aesd_dev {
     /**
      * TODO: Add structure(s) and locks needed to complete assignment
@@ -41,6 +54,23 @@ struct aesd_dev {
     struct aesd_buffer_entry data_buffer;
     struct aesd_circular_buffer buffer;
     struct mutex lock;
+    /*
+     * Bytes actually stored for each buffer.entry, or 0 if the entry is kept
+     * verbatim.  entry.size is always the uncompressed size, so file offsets
+     * are the same whether or not an entry is compressed.
+     */
+    size_t stored_size[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    /* LZ4 working memory and output scratch, used under lock */
+    void *compress_wrkmem;
+    char *compress_buf;
+    size_t compress_buf_size;
+    /* Last entry decompressed for reading, dropped whenever an entry is added */
+    const char *cache_src;
+    char *cache;
+    size_t cache_size;
+    struct aesd_compress_stats stats;
+    /* aesd_write() calls so far, numbering them for the aesdchar tracepoints */
+    u64 write_seq;
 };
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
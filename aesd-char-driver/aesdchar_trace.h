@@ -0,0 +1,132 @@
+/*
+ * aesdchar_trace.h
+ *
+ * Tracepoints of the aesdchar driver, under the "aesdchar" trace system, e.g.
+ * /sys/kernel/tracing/events/aesdchar/ or "perf record -e 'aesdchar:*'".
+ * Every write gets a sequence number, reported when the write is locked and
+ * when it returns, which names one aesd_write() call.  The events carry no
+ * user-space id: tracers stamp them with the calling thread, which is how
+ * server/aesd-trace.sh matches them to the aesdsocket record being committed
+ * on that thread.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(_AESDCHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _AESDCHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(aesdchar_enter,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+    ),
+    TP_printk("count=%zu pos=%lld", __entry->count, __entry->pos)
+);
+
+DEFINE_EVENT(aesdchar_enter, aesdchar_write_enter,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos)
+);
+
+DEFINE_EVENT(aesdchar_enter, aesdchar_read_enter,
+    TP_PROTO(size_t count, loff_t pos),
+    TP_ARGS(count, pos)
+);
+
+/* dev->lock taken by write @seq, with @pending bytes of an unterminated write held */
+TRACE_EVENT(aesdchar_write_locked,
+    TP_PROTO(u64 seq, size_t pending),
+    TP_ARGS(seq, pending),
+    TP_STRUCT__entry(
+        __field(u64, seq)
+        __field(size_t, pending)
+    ),
+    TP_fast_assign(
+        __entry->seq = seq;
+        __entry->pending = pending;
+    ),
+    TP_printk("seq=%llu pending=%zu", __entry->seq, __entry->pending)
+);
+
+/* krealloc() of the pending write buffer returned */
+TRACE_EVENT(aesdchar_write_alloc,
+    TP_PROTO(u64 seq, size_t size),
+    TP_ARGS(seq, size),
+    TP_STRUCT__entry(
+        __field(u64, seq)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->seq = seq;
+        __entry->size = size;
+    ),
+    TP_printk("seq=%llu size=%zu", __entry->seq, __entry->size)
+);
+
+/* Write @seq returns @ret; @committed if it completed an entry of the ring */
+TRACE_EVENT(aesdchar_write_exit,
+    TP_PROTO(u64 seq, ssize_t ret, bool committed),
+    TP_ARGS(seq, ret, committed),
+    TP_STRUCT__entry(
+        __field(u64, seq)
+        __field(ssize_t, ret)
+        __field(bool, committed)
+    ),
+    TP_fast_assign(
+        __entry->seq = seq;
+        __entry->ret = ret;
+        __entry->committed = committed;
+    ),
+    TP_printk("seq=%llu ret=%zd committed=%d", __entry->seq, __entry->ret, __entry->committed)
+);
+
+TRACE_EVENT(aesdchar_read_exit,
+    TP_PROTO(ssize_t ret, loff_t pos),
+    TP_ARGS(ret, pos),
+    TP_STRUCT__entry(
+        __field(ssize_t, ret)
+        __field(loff_t, pos)
+    ),
+    TP_fast_assign(
+        __entry->ret = ret;
+        __entry->pos = pos;
+    ),
+    TP_printk("ret=%zd pos=%lld", __entry->ret, __entry->pos)
+);
+
+TRACE_EVENT(aesdchar_ioctl,
+    TP_PROTO(unsigned int cmd, u32 write_cmd, u32 write_cmd_offset, long ret),
+    TP_ARGS(cmd, write_cmd, write_cmd_offset, ret),
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(u32, write_cmd)
+        __field(u32, write_cmd_offset)
+        __field(long, ret)
+    ),
+    TP_fast_assign(
+        __entry->cmd = cmd;
+        __entry->write_cmd = write_cmd;
+        __entry->write_cmd_offset = write_cmd_offset;
+        __entry->ret = ret;
+    ),
+    TP_printk("cmd=%#x write_cmd=%u write_cmd_offset=%u ret=%ld", __entry->cmd,
+              __entry->write_cmd, __entry->write_cmd_offset, __entry->ret)
+);
+
+#endif /* _AESDCHAR_TRACE_H */
+
+/* Tracepoint definitions are generated from this directory, not include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
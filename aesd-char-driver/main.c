@@ -11,14 +11,32 @@
  */
 
 #include "aesdchar.h"
+#include <linux/err.h>
+#include <linux/ktime.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/moduleparam.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 
 #define FALSE 0
 #define TRUE 1
 
+/* The kernel's LZ4 library is optional; without it the compress option does nothing */
+#if IS_ENABLED(CONFIG_LZ4_COMPRESS) && IS_ENABLED(CONFIG_LZ4_DECOMPRESS)
+#define AESD_HAVE_LZ4 1
+#endif
+
+static bool compress;
+module_param(compress, bool, 0644);
+MODULE_PARM_DESC(compress, "LZ4 compress entries as they are committed (default off)");
+
 int aesd_major = 0; // use dynamic major
 int aesd_minor = 0;
-loff_t offset_backup = 0;
-uint8_t ioctl_called = 0;
 MODULE_AUTHOR("Vivek Tewari");
 MODULE_LICENSE("Dual BSD/GPL");
 
@@ -26,6 +44,123 @@ struct aesd_dev aesd_device;
 struct class *aesd_class;
 struct device *aesd_device_node;
 
+/**
+ * Replace the pending write in @param dev->data_buffer with its LZ4
+ * compressed form if that is smaller, recording the stored size for the
+ * slot it is about to be added to.  Keeps the write verbatim on any failure.
+ */
+static void aesd_compress_pending(struct aesd_dev *dev) {
+    uint8_t slot = dev->buffer.in_offs;
+
+    dev->stored_size[slot] = 0;
+#ifdef AESD_HAVE_LZ4
+    if (compress && dev->compress_wrkmem != NULL && dev->data_buffer.size <= LZ4_MAX_INPUT_SIZE) {
+        struct aesd_buffer_entry *pending = &dev->data_buffer;
+        size_t bound = LZ4_compressBound(pending->size);
+        u64 start = ktime_get_ns();
+        char *packed;
+        int packed_size;
+
+        if (dev->compress_buf_size < bound) {
+            kvfree(dev->compress_buf);
+            dev->compress_buf = kvmalloc(bound, GFP_KERNEL);
+            dev->compress_buf_size = dev->compress_buf ? bound : 0;
+        }
+        if (dev->compress_buf == NULL) {
+            return;
+        }
+
+        packed_size = LZ4_compress_default(pending->buffptr, dev->compress_buf, pending->size,
+                                           bound, dev->compress_wrkmem);
+        dev->stats.compress_ns += ktime_get_ns() - start;
+        dev->stats.bytes_in += pending->size;
+        if (packed_size <= 0 || (size_t)packed_size >= pending->size ||
+            (packed = kmemdup(dev->compress_buf, packed_size, GFP_KERNEL)) == NULL) {
+            dev->stats.entries_stored_raw++;
+            dev->stats.bytes_out += pending->size;
+            return;
+        }
+
+        kfree(pending->buffptr);
+        pending->buffptr = packed;
+        dev->stored_size[slot] = packed_size;
+        dev->stats.entries_compressed++;
+        dev->stats.bytes_out += packed_size;
+    }
+#endif
+}
+
+/**
+ * @return the uncompressed contents of @param entry, which must be one of
+ * @param dev->buffer's entries, or NULL if it could not be decompressed.
+ * Compressed entries are decompressed into a cache that lasts until the next
+ * entry is added, so reading an entry in several pieces decompresses it once.
+ */
+static const char *aesd_entry_data(struct aesd_dev *dev, struct aesd_buffer_entry *entry) {
+    size_t stored = dev->stored_size[entry - dev->buffer.entry];
+
+    if (stored == 0) {
+        return entry->buffptr;
+    }
+    if (dev->cache_src == entry->buffptr) {
+        return dev->cache;
+    }
+#ifdef AESD_HAVE_LZ4
+    {
+        u64 start = ktime_get_ns();
+
+        if (dev->cache_size < entry->size) {
+            kvfree(dev->cache);
+            dev->cache = kvmalloc(entry->size, GFP_KERNEL);
+            dev->cache_size = dev->cache ? entry->size : 0;
+        }
+        dev->cache_src = NULL;
+        if (dev->cache == NULL ||
+            LZ4_decompress_safe(entry->buffptr, dev->cache, stored, entry->size) !=
+                (int)entry->size) {
+            return NULL;
+        }
+        dev->cache_src = entry->buffptr;
+        dev->stats.decompressions++;
+        dev->stats.decompress_ns += ktime_get_ns() - start;
+        return dev->cache;
+    }
+#else
+    return NULL;
+#endif
+}
+
+static int aesd_stats_show(struct seq_file *m, void *v) {
+    struct aesd_dev *dev = &aesd_device;
+    struct aesd_compress_stats stats;
+    size_t logical = 0, stored = 0;
+    uint8_t index;
+
+    if (mutex_lock_interruptible(&dev->lock)) {
+        return -ERESTARTSYS;
+    }
+    for (index = 0; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++) {
+        if (dev->buffer.entry[index].buffptr) {
+            logical += dev->buffer.entry[index].size;
+            stored += dev->stored_size[index] ? dev->stored_size[index] : dev->buffer.entry[index].size;
+        }
+    }
+    stats = dev->stats;
+    mutex_unlock(&dev->lock);
+
+    seq_printf(m, "compress %d\n", compress);
+    seq_printf(m, "stored_logical_bytes %zu\n", logical);
+    seq_printf(m, "stored_bytes %zu\n", stored);
+    seq_printf(m, "entries_compressed %llu\n", stats.entries_compressed);
+    seq_printf(m, "entries_stored_raw %llu\n", stats.entries_stored_raw);
+    seq_printf(m, "compress_bytes_in %llu\n", stats.bytes_in);
+    seq_printf(m, "compress_bytes_out %llu\n", stats.bytes_out);
+    seq_printf(m, "compress_ns %llu\n", stats.compress_ns);
+    seq_printf(m, "decompressions %llu\n", stats.decompressions);
+    seq_printf(m, "decompress_ns %llu\n", stats.decompress_ns);
+    return 0;
+}
+
 int aesd_open(struct inode *inode, struct file *filp) {
     struct aesd_dev *ptr_aesd_dev;
     PDEBUG("open");
@@ -33,11 +168,6 @@ int aesd_open(struct inode *inode, struct file *filp) {
     ptr_aesd_dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
     filp->private_data = ptr_aesd_dev;
 
-    if (ioctl_called) {
-        ioctl_called = 0;
-        filp->f_pos = offset_backup;
-    }
-
     return 0;
 }
 
@@ -48,15 +178,18 @@ int aesd_release(struct inode *inode, struct file *filp) {
 
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
     ssize_t retval = 0;
-    ssize_t offset;
+    size_t offset;
     struct aesd_buffer_entry *ret_entry = 0;
     struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
+    const char *data;
 
     PDEBUG("read %zu bytes with offset %lld\n", count, *f_pos);
     PDEBUG("filp->f_offs = %lld\n", filp->f_pos);
+    trace_aesdchar_read_enter(count, *f_pos);
 
     if (mutex_lock_interruptible(&(dev->lock))) {
         PDEBUG("ERROR: Couldn't acquire lock\n");
+        trace_aesdchar_read_exit(-ERESTARTSYS, *f_pos);
         return -ERESTARTSYS;
     }
 
@@ -65,42 +198,62 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count, loff_t *f_p
     if (ret_entry == NULL) {
         PDEBUG("Not enough data written!\n");
         mutex_unlock(&(dev->lock));
+        trace_aesdchar_read_exit(0, *f_pos);
         return 0;
     }
 
-    retval = ret_entry->size - offset;
-    if (copy_to_user(buf, (void *)(ret_entry->buffptr + offset), retval)) {
+    data = aesd_entry_data(dev, ret_entry);
+    if (data == NULL) {
+        PDEBUG("Error decompressing entry\n");
+        mutex_unlock(&(dev->lock));
+        trace_aesdchar_read_exit(-EIO, *f_pos);
+        return -EIO;
+    }
+
+    /* Never more than the caller asked for; the rest comes with the next read */
+    retval = min_t(size_t, ret_entry->size - offset, count);
+    if (copy_to_user(buf, (void *)(data + offset), retval)) {
         PDEBUG("Error copying data to user buffer\n");
         mutex_unlock(&(dev->lock));
+        trace_aesdchar_read_exit(-EFAULT, *f_pos);
         return -EFAULT;
     }
 
     *f_pos += retval;
 
-    PDEBUG("Data copied: %s", ret_entry->buffptr + offset);
+    PDEBUG("Data copied: %.*s", (int)retval, data + offset);
     PDEBUG("new offset: %lld\n", *f_pos);
     PDEBUG("retval: %ld\n", retval);
     PDEBUG("-------------------------------\n");
 
     mutex_unlock(&(dev->lock));
+    trace_aesdchar_read_exit(retval, *f_pos);
     return retval;
 }
 
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
     ssize_t retval = -ENOMEM;
     struct aesd_dev *dev = (struct aesd_dev *)filp->private_data;
+    bool committed = false;
+    u64 seq;
 
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
+    trace_aesdchar_write_enter(count, *f_pos);
 
     if (mutex_lock_interruptible(&(dev->lock))) {
         PDEBUG("ERROR: Couldn't acquire lock\n");
+        trace_aesdchar_write_exit(0, -ERESTARTSYS, false);
         return -ERESTARTSYS;
     }
+    seq = ++dev->write_seq;
+    trace_aesdchar_write_locked(seq, dev->data_buffer.size);
 
     void *new_buffptr = krealloc(dev->data_buffer.buffptr, dev->data_buffer.size + count, GFP_KERNEL);
+    trace_aesdchar_write_alloc(seq, dev->data_buffer.size + count);
     if (new_buffptr == NULL) {
         PDEBUG("Error allocating memory!\n");
         mutex_unlock(&(dev->lock));
+        trace_aesdchar_write_exit(seq, -ENOMEM, false);
         return -ENOMEM;
     }
 
@@ -109,6 +262,7 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff
     if (copy_from_user((char *)(dev->data_buffer.buffptr + dev->data_buffer.size), buf, count)) {
         PDEBUG("Error copying data from user buffer\n");
         mutex_unlock(&(dev->lock));
+        trace_aesdchar_write_exit(seq, -EFAULT, false);
         return -EFAULT;
     }
 
@@ -118,13 +272,18 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff
     if (dev->data_buffer.buffptr[dev->data_buffer.size - 1] != '\n') {
         PDEBUG("WARNING: Buffer has no end line\n");
     } else {
+        aesd_compress_pending(dev);
+        /* The cached entry may be the one about to be overwritten and freed */
+        dev->cache_src = NULL;
         aesd_circular_buffer_add_entry(&(dev->buffer), &(dev->data_buffer));
         dev->data_buffer.size = 0;
         dev->data_buffer.buffptr = NULL;
+        committed = true;
     }
 
     *f_pos += count;
     mutex_unlock(&(dev->lock));
+    trace_aesdchar_write_exit(seq, retval, committed);
     return retval;
 }
 
@@ -190,14 +349,114 @@ static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, u
     }
 
     new_offset += write_cmd_offset;
+    /* Only this descriptor moves; other openers still read from the start */
     filp->f_pos = new_offset;
-    offset_backup = filp->f_pos;
-    ioctl_called = 1;
 
     mutex_unlock(&(dev->lock));
     return 0;
 }
 
+/**
+ * @return true if the @param size bytes at @param data match the
+ * @param len byte @param pattern under AESD_FILTER_* @param mode.
+ * Candidates are found with memchr() on the first pattern byte, which is the
+ * architecture's optimised scan where it has one; SIMD registers aren't
+ * available here without kernel_fpu_begin().
+ */
+static bool aesd_entry_matches(const char *data, size_t size, const char *pattern, size_t len,
+                               u32 mode) {
+    const char *p = data;
+    const char *last;
+
+    if (len == 0) {
+        return true;
+    }
+    if (size < len) {
+        return false;
+    }
+    if (mode == AESD_FILTER_PREFIX) {
+        return memcmp(data, pattern, len) == 0;
+    }
+    last = data + size - len;
+    while (p <= last && (p = memchr(p, pattern[0], last - p + 1)) != NULL) {
+        if (memcmp(p + 1, pattern + 1, len - 1) == 0) {
+            return true;
+        }
+        p++;
+    }
+    return false;
+}
+
+/**
+ * Copy the entries matching the pattern described by @param uarg, oldest
+ * first, to its buffer while it has room for the whole entry, and report
+ * the bytes copied and needed.
+ */
+static long aesd_filter_entries(struct aesd_dev *dev, struct aesd_filter __user *uarg) {
+    struct aesd_filter filter;
+    char __user *buf;
+    char *pattern = NULL;
+    uint8_t count, i;
+    long retval = 0;
+
+    if (copy_from_user(&filter, uarg, sizeof(filter))) {
+        return -EFAULT;
+    }
+    if (filter.mode > AESD_FILTER_PREFIX || filter.pattern_len > AESD_FILTER_MAX_PATTERN) {
+        return -EINVAL;
+    }
+    if (filter.pattern_len > 0) {
+        pattern = memdup_user(u64_to_user_ptr(filter.pattern), filter.pattern_len);
+        if (IS_ERR(pattern)) {
+            return PTR_ERR(pattern);
+        }
+    }
+    buf = u64_to_user_ptr(filter.buf);
+    filter.copied = 0;
+    filter.needed = 0;
+    filter.matches = 0;
+
+    if (mutex_lock_interruptible(&(dev->lock))) {
+        kfree(pattern);
+        return -ERESTARTSYS;
+    }
+
+    count = dev->buffer.full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+                             : (dev->buffer.in_offs - dev->buffer.out_offs +
+                                AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) %
+                                   AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    for (i = 0; i < count; i++) {
+        struct aesd_buffer_entry *entry =
+            &dev->buffer.entry[(dev->buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+        const char *data = aesd_entry_data(dev, entry);
+
+        if (data == NULL) {
+            retval = -EIO;
+            break;
+        }
+        if (!aesd_entry_matches(data, entry->size, pattern, filter.pattern_len, filter.mode)) {
+            continue;
+        }
+        filter.matches++;
+        /* Stop copying at the first entry that doesn't fit, so the copy has no gaps */
+        if (filter.copied == filter.needed && entry->size <= filter.buf_len - filter.copied) {
+            if (copy_to_user(buf + filter.copied, data, entry->size)) {
+                retval = -EFAULT;
+                break;
+            }
+            filter.copied += entry->size;
+        }
+        filter.needed += entry->size;
+    }
+
+    mutex_unlock(&(dev->lock));
+    kfree(pattern);
+    if (retval == 0 && copy_to_user(uarg, &filter, sizeof(filter))) {
+        retval = -EFAULT;
+    }
+    return retval;
+}
+
 long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     long retval;
     struct aesd_seekto seekto;
@@ -205,9 +464,15 @@ long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     switch (cmd) {
         case AESDCHAR_IOCSEEKTO:
             if (copy_from_user(&seekto, (const void __user *)arg, sizeof(seekto))) {
+                trace_aesdchar_ioctl(cmd, 0, 0, -EFAULT);
                 return -EFAULT;
             }
             retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
+            trace_aesdchar_ioctl(cmd, seekto.write_cmd, seekto.write_cmd_offset, retval);
+            break;
+        case AESDCHAR_IOCFILTER:
+            retval = aesd_filter_entries(filp->private_data, (struct aesd_filter __user *)arg);
+            trace_aesdchar_ioctl(cmd, 0, 0, retval);
             break;
         default:
             return -EINVAL;
@@ -249,6 +514,7 @@ int aesd_init_module(void) {
         return result;
     }
     memset(&aesd_device, 0, sizeof(struct aesd_dev));
+    mutex_init(&aesd_device.lock);
 
     result = aesd_setup_cdev(&aesd_device);
     if (result) {
@@ -261,6 +527,15 @@ int aesd_init_module(void) {
     aesd_device.data_buffer.buffptr = kmalloc(0, GFP_KERNEL);
     aesd_device.data_buffer.size = 0;
 
+#ifdef AESD_HAVE_LZ4
+    aesd_device.compress_wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+#else
+    if (compress) {
+        printk(KERN_WARNING "aesdchar: kernel built without LZ4, compress has no effect\n");
+    }
+#endif
+    proc_create_single("aesdchar", 0444, NULL, aesd_stats_show);
+
     return 0;
 }
 
@@ -275,6 +550,10 @@ void aesd_cleanup_module(void) {
     if (aesd_device.data_buffer.buffptr != NULL) {
         kfree(aesd_device.data_buffer.buffptr);
     }
+    remove_proc_entry("aesdchar", NULL);
+    kvfree(aesd_device.compress_wrkmem);
+    kvfree(aesd_device.compress_buf);
+    kvfree(aesd_device.cache);
     cdev_del(&(aesd_device.cdev));
     unregister_chrdev_region(devno, 1);
 }
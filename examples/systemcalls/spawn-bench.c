@@ -0,0 +1,98 @@
+/**
+ * @file spawn-bench.c
+ * @brief Spawns per second of fork() + execv() against do_exec() as the
+ * resident size of the parent grows.
+ *
+ * Usage: spawn-bench [max_rss_mib] [spawns_per_step]
+ * The parent touches an increasing amount of heap (0, 64, 128, ... MiB up to
+ * max_rss_mib) and at each step runs /bin/true spawns_per_step times with
+ * both methods.  fork() has to copy the page tables of everything touched,
+ * so its rate drops as the parent grows; the posix_spawn() path in do_exec()
+ * shares the parent's address space until the exec and should stay flat.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "systemcalls.h"
+
+#define RSS_STEP_MIB 64
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool fork_exec_true(void)
+{
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0)
+    {
+        char *argv[] = { "/bin/true", NULL };
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) == -1)
+    {
+        perror("waitpid");
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static double spawn_rate(bool (*spawn)(void), int spawns)
+{
+    double start = now_s();
+    for (int i = 0; i < spawns; i++)
+    {
+        if (!spawn())
+        {
+            fprintf(stderr, "spawn failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return spawns / (now_s() - start);
+}
+
+static bool posix_spawn_true(void)
+{
+    return do_exec(1, "/bin/true");
+}
+
+int main(int argc, char *argv[])
+{
+    int max_rss_mib = argc > 1 ? atoi(argv[1]) : 512;
+    int spawns = argc > 2 ? atoi(argv[2]) : 200;
+    char *heap = NULL;
+
+    printf("%10s %16s %16s\n", "rss_mib", "fork+execv/s", "posix_spawn/s");
+    for (int rss = 0; rss <= max_rss_mib; rss += RSS_STEP_MIB)
+    {
+        if (rss > 0)
+        {
+            /* Leaked on purpose: the point is to keep the parent growing */
+            heap = malloc((size_t)RSS_STEP_MIB << 20);
+            if (heap == NULL)
+            {
+                perror("malloc");
+                return EXIT_FAILURE;
+            }
+            memset(heap, 1, (size_t)RSS_STEP_MIB << 20);
+        }
+        double fork_rate = spawn_rate(fork_exec_true, spawns);
+        double spawn_rate_s = spawn_rate(posix_spawn_true, spawns);
+        printf("%10d %16.0f %16.0f\n", rss, fork_rate, spawn_rate_s);
+    }
+    return EXIT_SUCCESS;
+}
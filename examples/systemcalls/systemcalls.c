@@ -1,9 +1,63 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <sys/wait.h> 
 #include <unistd.h>
 
+extern char **environ;
+
+/**
+ * Start @param command with posix_spawn() rather than fork() + execv().
+ * glibc implements it with clone(CLONE_VM | CLONE_VFORK), so the parent's
+ * page tables are never copied and the cost of a spawn no longer grows with
+ * the size of the calling process.
+ * @param file_actions - optional descriptor setup applied in the child, or NULL
+ * @return the child pid, or -1 if the command could not be started
+ */
+static pid_t spawn_command(char *command[], const posix_spawn_file_actions_t *file_actions)
+{
+    pid_t pid;
+    int err = posix_spawn(&pid, command[0], file_actions, NULL, command, environ);
+    if (err != 0)
+    {
+        fprintf(stderr, "posix_spawn %s: %s\n", command[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+/**
+ * Wait for @param pid to finish, storing its waitpid() status in
+ * @param status_out unless it is NULL.
+ * @return true if it exited normally with status 0
+ */
+static bool wait_for_child(pid_t pid, int *status_out)
+{
+    int status;
+    while (waitpid(pid, &status, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            perror("waitpid");
+            return false;
+        }
+    }
+    if (status_out != NULL)
+    {
+        *status_out = status;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
 /**
  * @param cmd the command to execute with system()
  * @return true if the command in @param cmd was executed
@@ -28,12 +82,13 @@ bool do_system(const char *cmd)
 *   Since exec() does not perform path expansion, the command to execute needs
 *   to be an absolute path.
 * @param ... - A list of 1 or more arguments after the @param count argument.
-*   The first is always the full path to the command to execute with execv()
-*   The remaining arguments are a list of arguments to pass to the command in execv()
+*   The first is always the full path to the command to execute with posix_spawn()
+*   The remaining arguments are a list of arguments to pass to the command
 * @return true if the command @param ... with arguments @param arguments were executed successfully
-*   using the execv() call, false if an error occurred, either in invocation of the
-*   fork, waitpid, or execv() command, or if a non-zero return value was returned
-*   by the command issued in @param arguments with the specified arguments.
+*   using the posix_spawn() call, false if an error occurred, either in invocation of
+*   posix_spawn() or waitpid(), if the command was killed by a signal, or if a non-zero
+*   return value was returned by the command issued in @param arguments with the
+*   specified arguments.
 */
 
 bool do_exec(int count, ...)
@@ -47,54 +102,375 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
+    va_end(args);
+
+    pid_t pid = spawn_command(command, NULL);
+    if (pid == -1)
+    {
+        return false;
+    }
+    return wait_for_child(pid, NULL);
+}
+
+/**
+* @param outputfile - The full path to the file to write with command output.
+*   This file will be closed at completion of the function call.
+* All other parameters, see do_exec above
+*/
+bool do_exec_redirect(const char *outputfile, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    // The child opens the output file straight onto stdout (create or truncate it)
+    posix_spawn_file_actions_t file_actions;
+    if (posix_spawn_file_actions_init(&file_actions) != 0)
+    {
+        perror("posix_spawn_file_actions_init");
+        return false;
+    }
+    if (posix_spawn_file_actions_addopen(&file_actions, STDOUT_FILENO, outputfile,
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644) != 0)
+    {
+        perror("posix_spawn_file_actions_addopen");
+        posix_spawn_file_actions_destroy(&file_actions);
+        return false;
+    }
 
-    pid_t pid = fork();
+    pid_t pid = spawn_command(command, &file_actions);
+    posix_spawn_file_actions_destroy(&file_actions);
     if (pid == -1)
     {
-        perror("fork failed");
-        va_end(args);
         return false;
     }
-    else if (pid == 0)
+    return wait_for_child(pid, NULL);
+}
+
+/**
+ * Start one command of do_exec_many(), redirecting its stdout if requested.
+ * @return the child pid, or -1 if it could not be started
+ */
+static pid_t spawn_exec_command(const struct exec_command *command)
+{
+    if (command->outputfile == NULL)
+    {
+        return spawn_command((char **)command->argv, NULL);
+    }
+
+    posix_spawn_file_actions_t file_actions;
+    if (posix_spawn_file_actions_init(&file_actions) != 0)
+    {
+        return -1;
+    }
+    pid_t pid = -1;
+    if (posix_spawn_file_actions_addopen(&file_actions, STDOUT_FILENO, command->outputfile,
+                                         O_WRONLY | O_CREAT | O_TRUNC, 0644) == 0)
+    {
+        pid = spawn_command((char **)command->argv, &file_actions);
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+    return pid;
+}
+
+/**
+ * @param commands - the commands to run, see struct exec_command
+ * @param count - the number of entries in @param commands and @param results
+ * @param max_concurrent - the most children alive at any time, 0 for no limit
+ * @param results - receives the outcome of commands[i] in results[i]
+ * @return true if every command was started and exited with status 0
+ *
+ * Children are tracked with pidfds and reaped in whatever order they finish,
+ * so a slow command never holds up a free slot; only the child a pidfd
+ * reports as exited is waited for, so other children of the caller are left
+ * alone.  On kernels without pidfd_open() (before 5.3) the oldest running
+ * child is waited for instead.
+ */
+bool do_exec_many(const struct exec_command *commands, size_t count,
+                  unsigned int max_concurrent, struct exec_result *results)
+{
+    if (max_concurrent == 0 || max_concurrent > count)
+    {
+        max_concurrent = count;
+    }
+    if (count == 0)
     {
-        // Child process
-        if(execv(command[0], command) == -1)
+        return true;
+    }
+
+    struct pollfd *pfds = calloc(max_concurrent, sizeof(*pfds));
+    pid_t *pids = calloc(max_concurrent, sizeof(*pids));
+    size_t *indexes = calloc(max_concurrent, sizeof(*indexes));
+    if (pfds == NULL || pids == NULL || indexes == NULL)
+    {
+        perror("calloc");
+        free(pfds);
+        free(pids);
+        free(indexes);
+        return false;
+    }
+
+    bool all_succeeded = true;
+    unsigned int running = 0;
+    size_t next = 0;
+
+    while (next < count || running > 0)
+    {
+        while (next < count && running < max_concurrent)
         {
-	  // If execv returns, it must have failed
-	  perror("execv failed");
-          exit(1);
-	}
+            struct exec_result *result = &results[next];
+            memset(result, 0, sizeof(*result));
+            pid_t pid = spawn_exec_command(&commands[next]);
+            if (pid == -1)
+            {
+                all_succeeded = false;
+                next++;
+                continue;
+            }
+            result->started = true;
+            pfds[running].fd = (int)syscall(SYS_pidfd_open, pid, 0);
+            pfds[running].events = POLLIN;
+            pfds[running].revents = 0;
+            pids[running] = pid;
+            indexes[running] = next;
+            running++;
+            next++;
+        }
+        if (running == 0)
+        {
+            break;
+        }
+
+        /* Without pidfds, fall back to the oldest child */
+        unsigned int ready = 0;
+        if (pfds[0].fd != -1)
+        {
+            if (poll(pfds, running, -1) == -1 && errno != EINTR)
+            {
+                perror("poll");
+            }
+            while (ready < running && pfds[ready].fd != -1 && pfds[ready].revents == 0)
+            {
+                ready++;
+            }
+            if (ready == running)
+            {
+                continue;
+            }
+        }
+
+        struct exec_result *result = &results[indexes[ready]];
+        result->success = wait_for_child(pids[ready], &result->status);
+        all_succeeded = all_succeeded && result->success;
+        if (pfds[ready].fd != -1)
+        {
+            close(pfds[ready].fd);
+        }
+
+        /* Keep the running children packed at the front, in start order */
+        running--;
+        memmove(&pfds[ready], &pfds[ready + 1], (running - ready) * sizeof(*pfds));
+        memmove(&pids[ready], &pids[ready + 1], (running - ready) * sizeof(*pids));
+        memmove(&indexes[ready], &indexes[ready + 1], (running - ready) * sizeof(*indexes));
+    }
+
+    free(pfds);
+    free(pids);
+    free(indexes);
+    return all_succeeded;
+}
+
+/**
+ * Set up the descriptors of one do_pipeline() stage in @param file_actions.
+ * @param stdin_fd - read end of the pipe from the previous stage, or -1
+ * @param stdout_fd - write end of the pipe to the next stage, or -1
+ * @return 0 on success, an error number otherwise
+ */
+static int pipeline_file_actions(posix_spawn_file_actions_t *file_actions,
+                                 const struct pipeline_stage *stage, int stdin_fd, int stdout_fd)
+{
+    int err = 0;
+    if (stdin_fd != -1)
+    {
+        err = posix_spawn_file_actions_adddup2(file_actions, stdin_fd, STDIN_FILENO);
     }
-    else
+    if (err == 0 && stage->stdout_file != NULL)
     {
-        // Parent process
-        int status;
-        if (waitpid(pid, &status, 0) == -1)
+        err = posix_spawn_file_actions_addopen(file_actions, STDOUT_FILENO, stage->stdout_file,
+                                               O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    else if (err == 0 && stdout_fd != -1)
+    {
+        err = posix_spawn_file_actions_adddup2(file_actions, stdout_fd, STDOUT_FILENO);
+    }
+    if (err == 0 && stage->stderr_to_stdout)
+    {
+        err = posix_spawn_file_actions_adddup2(file_actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+    else if (err == 0 && stage->stderr_file != NULL)
+    {
+        err = posix_spawn_file_actions_addopen(file_actions, STDERR_FILENO, stage->stderr_file,
+                                               O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    return err;
+}
+
+/**
+ * Run @param count commands connected by pipes, stdout of each stage feeding
+ * stdin of the next, without starting a shell: the equivalent of
+ * "a | b > file" costs one posix_spawn() per stage instead of a /bin/sh
+ * startup plus its forks.  Each stage writes straight into its pipe or
+ * output file, so no data passes through the caller.
+ * @param stages - the stages in pipeline order, see struct pipeline_stage
+ * @return true if every stage was started and exited with status 0 (the
+ *   shell's "pipefail" behaviour), false otherwise
+ */
+bool do_pipeline(const struct pipeline_stage *stages, size_t count)
+{
+    pid_t *pids = malloc((count > 0 ? count : 1) * sizeof(*pids));
+    size_t started = 0;
+    int stdin_fd = -1;
+    bool ok = true;
+
+    if (pids == NULL)
+    {
+        perror("malloc");
+        return false;
+    }
+
+    for (size_t i = 0; i < count && ok; i++)
+    {
+        /* Pipe ends are close-on-exec; only the dup2() copies reach the child */
+        int pipe_fds[2] = { -1, -1 };
+        if (i + 1 < count && pipe2(pipe_fds, O_CLOEXEC) == -1)
         {
-            perror("waitpid");
-            va_end(args);
-            return false;
+            perror("pipe2");
+            ok = false;
+            break;
         }
 
-	// Check if the child is not exited successfully
-        if ((WIFEXITED(status) && WEXITSTATUS(status)) != 0)
+        posix_spawn_file_actions_t file_actions;
+        int err = posix_spawn_file_actions_init(&file_actions);
+        if (err == 0)
         {
-            va_end(args);
-            return false;
+            err = pipeline_file_actions(&file_actions, &stages[i], stdin_fd, pipe_fds[1]);
+            if (err == 0)
+            {
+                pids[started] = spawn_command((char **)stages[i].argv, &file_actions);
+                if (pids[started] == -1)
+                {
+                    ok = false;
+                }
+                else
+                {
+                    started++;
+                }
+            }
+            posix_spawn_file_actions_destroy(&file_actions);
+        }
+        if (err != 0)
+        {
+            fprintf(stderr, "pipeline stage %zu: %s\n", i, strerror(err));
+            ok = false;
         }
+
+        if (stdin_fd != -1)
+        {
+            close(stdin_fd);
+        }
+        if (pipe_fds[1] != -1)
+        {
+            close(pipe_fds[1]);
+        }
+        stdin_fd = pipe_fds[0];
+    }
+    if (stdin_fd != -1)
+    {
+        close(stdin_fd);
     }
 
-    va_end(args);
+    /* Started stages see end of file or EPIPE once their neighbours are gone */
+    for (size_t i = 0; i < started; i++)
+    {
+        ok = wait_for_child(pids[i], NULL) && ok;
+    }
+    free(pids);
+    return ok;
+}
 
-    return true;
+#define CAPTURE_READ_SIZE 4096
+/* Without a pidfd, how often to look in on a child that may have exited */
+#define CAPTURE_EXIT_POLL_MS 10
+
+/**
+ * Read what is available on @param fd into @param buf.
+ * @return 1 if the pipe may have more, 0 at end of file (or on error)
+ */
+static int capture_read(int fd, struct exec_output *buf)
+{
+    while (1)
+    {
+        if (buf->cap - buf->len < CAPTURE_READ_SIZE + 1)
+        {
+            size_t new_cap = buf->cap ? buf->cap * 2 : CAPTURE_READ_SIZE * 2;
+            char *new_data = realloc(buf->data, new_cap);
+            if (new_data == NULL)
+            {
+                perror("realloc");
+                return 0;
+            }
+            buf->data = new_data;
+            buf->cap = new_cap;
+        }
+        ssize_t n = read(fd, buf->data + buf->len, CAPTURE_READ_SIZE);
+        if (n > 0)
+        {
+            buf->len += n;
+            buf->data[buf->len] = '\0';
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        return (n == -1 && errno == EAGAIN) ? 1 : 0;
+    }
+}
+
+static long elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
 }
 
 /**
-* @param outputfile - The full path to the file to write with command output.
-*   This file will be closed at completion of the function call.
+* @param stdout_buf - receives the standard output of the command, or NULL to
+*   leave it connected to the caller's stdout
+* @param stderr_buf - the same for standard error
+* @param timeout_ms - how long to wait for the command, 0 or less to wait forever
+* @param kill_on_timeout - when the timeout expires, kill the command with SIGKILL;
+*   otherwise stop capturing (the command sees EPIPE from then on) and wait for it
 * All other parameters, see do_exec above
+* @return true if the command ran to completion within the timeout and exited
+*   with status 0.  On a timeout errno is set to ETIMEDOUT.  Whatever output was
+*   captured is left in the buffers in every case.
+*
+* Both pipes are drained together with poll(), so a command filling one pipe
+* while the caller waits on the other can't deadlock, and no temporary file
+* is needed to get at the output.  The child's pidfd is polled with them, so
+* the timeout still holds once the command closes its output, or when
+* nothing is captured at all.
 */
-bool do_exec_redirect(const char *outputfile, int count, ...)
+bool do_exec_capture(struct exec_output *stdout_buf, struct exec_output *stderr_buf,
+                     int timeout_ms, bool kill_on_timeout, int count, ...)
 {
     va_list args;
     va_start(args, count);
@@ -105,62 +481,141 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
+    va_end(args);
 
-    pid_t pid = fork();
-    if (pid == -1)
+    struct exec_output *bufs[2] = { stdout_buf, stderr_buf };
+    int pipes[2][2] = { { -1, -1 }, { -1, -1 } };
+    posix_spawn_file_actions_t file_actions;
+    if (posix_spawn_file_actions_init(&file_actions) != 0)
     {
-        perror("fork");
-        va_end(args);
+        perror("posix_spawn_file_actions_init");
         return false;
     }
-    else if (pid == 0)
-    {   
-    	// Open the output file for writing (create or truncate it)
-        int output_fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (output_fd == -1) {
-            // If file can't be opened, print error and exit
-            perror("open failed");
-            exit(1);
+
+    pid_t pid = -1;
+    bool ok = true;
+    for (i = 0; i < 2 && ok; i++)
+    {
+        if (bufs[i] == NULL)
+        {
+            continue;
         }
-        
-         // Redirect stdout to the output file using dup2
-        if (dup2(output_fd, STDOUT_FILENO) == -1) {
-            // If dup2 fails, print error and exit
-            perror("dup2 failed");
-            exit(1);
+        /* Only the parent's read end is non-blocking; the child's stdout stays blocking */
+        if (pipe2(pipes[i], O_CLOEXEC) == -1 ||
+            fcntl(pipes[i][0], F_SETFL, O_NONBLOCK) == -1 ||
+            posix_spawn_file_actions_adddup2(&file_actions, pipes[i][1],
+                                             i == 0 ? STDOUT_FILENO : STDERR_FILENO) != 0)
+        {
+            perror("capture pipe");
+            ok = false;
         }
-        
-        // Close the output file descriptor after duplicating it
-        close(output_fd);
-        
-        // Child process
-         if(execv(command[0], command) == -1)
+    }
+    if (ok)
+    {
+        pid = spawn_command(command, &file_actions);
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+    for (i = 0; i < 2; i++)
+    {
+        if (pipes[i][1] != -1)
         {
-		// If execv returns, it must have failed
-		perror("execv failed");
-		exit(1);
+            close(pipes[i][1]);
         }
     }
-    else
+    if (pid == -1)
     {
-        // Parent process
-        int status;
-        if (waitpid(pid, &status, 0) == -1)
+        for (i = 0; i < 2; i++)
         {
-            perror("waitpid");
-            va_end(args);
-            return false;
+            if (pipes[i][0] != -1)
+            {
+                close(pipes[i][0]);
+            }
         }
+        return false;
+    }
 
-	// Check if the child is not exited successfully
-        if ((WIFEXITED(status) && WEXITSTATUS(status)) != 0)
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    bool timed_out = false;
+    bool exited = false;
+    int pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    struct pollfd pfds[3];
+    for (i = 0; i < 2; i++)
+    {
+        pfds[i].fd = pipes[i][0];
+        pfds[i].events = POLLIN;
+    }
+    pfds[2].fd = pidfd;
+    pfds[2].events = POLLIN;
+
+    while (pfds[0].fd != -1 || pfds[1].fd != -1 || !exited)
+    {
+        int wait_ms = -1;
+        if (timeout_ms > 0)
         {
-            va_end(args);
-            return false;
+            long left = timeout_ms - elapsed_ms(&start);
+            if (left <= 0)
+            {
+                timed_out = true;
+                break;
+            }
+            wait_ms = (int)left;
+        }
+        if (pidfd == -1 && !exited && (wait_ms == -1 || wait_ms > CAPTURE_EXIT_POLL_MS))
+        {
+            wait_ms = CAPTURE_EXIT_POLL_MS;
+        }
+        if (poll(pfds, 3, wait_ms) == -1 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        for (i = 0; i < 2; i++)
+        {
+            if (pfds[i].fd != -1 && pfds[i].revents != 0 && !capture_read(pfds[i].fd, bufs[i]))
+            {
+                close(pfds[i].fd);
+                pfds[i].fd = -1;
+            }
+        }
+        if (!exited)
+        {
+            /* WNOWAIT leaves the child for wait_for_child() to reap */
+            siginfo_t info;
+            info.si_pid = 0;
+            if (waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) == -1)
+            {
+                perror("waitid");
+                break;
+            }
+            if (info.si_pid == pid)
+            {
+                exited = true;
+                pfds[2].fd = -1;
+            }
+        }
+    }
+    if (pidfd != -1)
+    {
+        close(pidfd);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        if (pfds[i].fd != -1)
+        {
+            close(pfds[i].fd);
         }
     }
 
-    va_end(args);
-
-    return true;
+    if (timed_out && kill_on_timeout)
+    {
+        kill(pid, SIGKILL);
+    }
+    ok = wait_for_child(pid, NULL);
+    if (timed_out)
+    {
+        errno = ETIMEDOUT;
+        return false;
+    }
+    return ok;
 }
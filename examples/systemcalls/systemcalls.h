@@ -1,9 +1,73 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+ * One command for do_exec_many().
+ * argv - NULL terminated argument list, argv[0] being the absolute path of
+ *   the command, as for execv()
+ * outputfile - if not NULL, stdout of the command is written to this file
+ *   (created or truncated)
+ */
+struct exec_command
+{
+    char *const *argv;
+    const char *outputfile;
+};
+
+/**
+ * Outcome of one command run by do_exec_many().
+ * status - the raw waitpid() status, valid when started is true
+ * started - false if the command could not be spawned at all
+ * success - true if the command exited normally with status 0
+ */
+struct exec_result
+{
+    int status;
+    bool started;
+    bool success;
+};
+
+bool do_exec_many(const struct exec_command *commands, size_t count,
+                  unsigned int max_concurrent, struct exec_result *results);
+
+/**
+ * One stage of do_pipeline().
+ * argv - NULL terminated argument list, argv[0] being the absolute path of
+ *   the command, as for execv()
+ * stdout_file - if not NULL, stdout of this stage goes to this file (created
+ *   or truncated) instead of the next stage, which then reads end of file
+ * stderr_file - if not NULL, stderr of this stage goes to this file
+ * stderr_to_stdout - send stderr wherever stdout goes, like 2>&1
+ */
+struct pipeline_stage
+{
+    char *const *argv;
+    const char *stdout_file;
+    const char *stderr_file;
+    bool stderr_to_stdout;
+};
+
+bool do_pipeline(const struct pipeline_stage *stages, size_t count);
+
+/**
+ * Growable buffer receiving the output of do_exec_capture().  Start it
+ * zeroed (or reuse one from an earlier call, which appends to it); data is
+ * allocated as needed, always NUL terminated, and freed by the caller.
+ */
+struct exec_output
+{
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+bool do_exec_capture(struct exec_output *stdout_buf, struct exec_output *stderr_buf,
+                     int timeout_ms, bool kill_on_timeout, int count, ...);
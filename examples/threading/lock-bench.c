@@ -0,0 +1,229 @@
+/**
+ * @file lock-bench.c
+ * @brief Throughput and fairness of the locks in locks.h against pthread_mutex_t
+ *
+ * Usage: lock-bench [duration_ms] [max_threads]
+ * For every lock, thread count (1, 2, 4, ... max_threads) and pair of
+ * wait_to_obtain_us / wait_to_release_us values, each thread loops for
+ * duration_ms: busy-wait wait_to_obtain_us outside the lock, acquire, busy-wait
+ * wait_to_release_us inside it, release.  The busy-waits stand in for the work
+ * done around aesdsocket's data_mutex; usleep() can't resolve microseconds.
+ *
+ * Reported per run:
+ *  - acquisitions per second over all threads
+ *  - Jain's fairness index of the per-thread acquisition counts (1.0 means
+ *    every thread got the same share, 1/threads means one thread got it all)
+ *  - the fewest acquisitions any single thread managed, as a share of the mean
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "locks.h"
+
+enum lock_kind
+{
+    LOCK_PTHREAD_MUTEX,
+    LOCK_SPIN,
+    LOCK_TICKET,
+    LOCK_FUTEX,
+    LOCK_MCS,
+    LOCK_KIND_MAX,
+};
+
+static const char *lock_names[LOCK_KIND_MAX] = {
+    "pthread_mutex", "spin", "ticket", "futex_adaptive", "mcs",
+};
+
+static const struct
+{
+    int wait_to_obtain_us;
+    int wait_to_release_us;
+} delays[] = {
+    { 0, 0 }, { 0, 1 }, { 1, 1 }, { 10, 1 }, { 0, 10 }, { 10, 10 },
+};
+
+struct bench
+{
+    enum lock_kind kind;
+    int wait_to_obtain_us;
+    int wait_to_release_us;
+    atomic_bool start;
+    atomic_bool stop;
+    pthread_mutex_t mutex;
+    struct spin_lock spin;
+    struct ticket_lock ticket;
+    struct futex_mutex futex;
+    struct mcs_lock mcs;
+    /* Touched inside the lock so the critical section has a shared write */
+    unsigned long shared_counter;
+};
+
+struct bench_thread
+{
+    struct bench *bench;
+    pthread_t thread;
+    unsigned long acquisitions;
+} __attribute__((aligned(64)));
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void busy_wait_us(int us)
+{
+    if (us <= 0)
+    {
+        return;
+    }
+    uint64_t end = now_ns() + (uint64_t)us * 1000;
+    while (now_ns() < end)
+    {
+        cpu_relax();
+    }
+}
+
+static void *bench_thread_main(void *arg)
+{
+    struct bench_thread *self = (struct bench_thread *)arg;
+    struct bench *bench = self->bench;
+    struct mcs_node node;
+    unsigned long acquisitions = 0;
+
+    while (!atomic_load_explicit(&bench->start, memory_order_acquire))
+    {
+        cpu_relax();
+    }
+    while (!atomic_load_explicit(&bench->stop, memory_order_relaxed))
+    {
+        busy_wait_us(bench->wait_to_obtain_us);
+        switch (bench->kind)
+        {
+            case LOCK_PTHREAD_MUTEX:
+                pthread_mutex_lock(&bench->mutex);
+                break;
+            case LOCK_SPIN:
+                spin_lock(&bench->spin);
+                break;
+            case LOCK_TICKET:
+                ticket_lock(&bench->ticket);
+                break;
+            case LOCK_FUTEX:
+                futex_mutex_lock(&bench->futex);
+                break;
+            default:
+                mcs_lock(&bench->mcs, &node);
+                break;
+        }
+        bench->shared_counter++;
+        busy_wait_us(bench->wait_to_release_us);
+        switch (bench->kind)
+        {
+            case LOCK_PTHREAD_MUTEX:
+                pthread_mutex_unlock(&bench->mutex);
+                break;
+            case LOCK_SPIN:
+                spin_unlock(&bench->spin);
+                break;
+            case LOCK_TICKET:
+                ticket_unlock(&bench->ticket);
+                break;
+            case LOCK_FUTEX:
+                futex_mutex_unlock(&bench->futex);
+                break;
+            default:
+                mcs_unlock(&bench->mcs, &node);
+                break;
+        }
+        acquisitions++;
+    }
+    self->acquisitions = acquisitions;
+    return NULL;
+}
+
+static void run(enum lock_kind kind, unsigned int threads, int wait_to_obtain_us,
+                int wait_to_release_us, int duration_ms)
+{
+    struct bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.kind = kind;
+    bench.wait_to_obtain_us = wait_to_obtain_us;
+    bench.wait_to_release_us = wait_to_release_us;
+    pthread_mutex_init(&bench.mutex, NULL);
+
+    struct bench_thread *workers = aligned_alloc(64, threads * sizeof(struct bench_thread));
+    if (workers == NULL)
+    {
+        perror("aligned_alloc");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        workers[i].bench = &bench;
+        workers[i].acquisitions = 0;
+        if (pthread_create(&workers[i].thread, NULL, bench_thread_main, &workers[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint64_t start = now_ns();
+    atomic_store_explicit(&bench.start, true, memory_order_release);
+    struct timespec duration = { duration_ms / 1000, (long)(duration_ms % 1000) * 1000000L };
+    nanosleep(&duration, NULL);
+    atomic_store(&bench.stop, true);
+
+    double total = 0, sum_squares = 0;
+    unsigned long fewest = (unsigned long)-1;
+    for (unsigned int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        double n = (double)workers[i].acquisitions;
+        total += n;
+        sum_squares += n * n;
+        if (workers[i].acquisitions < fewest)
+        {
+            fewest = workers[i].acquisitions;
+        }
+    }
+    double elapsed_s = (now_ns() - start) / 1e9;
+    double jain = sum_squares > 0 ? total * total / (threads * sum_squares) : 0;
+    double fewest_share = total > 0 ? fewest / (total / threads) : 0;
+
+    printf("%-15s %7u %9d %10d %14.0f %8.3f %8.3f\n", lock_names[kind], threads,
+           wait_to_obtain_us, wait_to_release_us, total / elapsed_s, jain, fewest_share);
+    fflush(stdout);
+
+    pthread_mutex_destroy(&bench.mutex);
+    free(workers);
+}
+
+int main(int argc, char *argv[])
+{
+    int duration_ms = argc > 1 ? atoi(argv[1]) : 200;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max_threads = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                        : (cpus > 0 ? (unsigned int)cpus * 2 : 2);
+
+    printf("%-15s %7s %9s %10s %14s %8s %8s\n", "lock", "threads", "obtain_us", "release_us",
+           "acquisitions/s", "jain", "min/avg");
+    for (size_t d = 0; d < sizeof(delays) / sizeof(delays[0]); d++)
+    {
+        for (unsigned int threads = 1; threads <= max_threads; threads *= 2)
+        {
+            for (int kind = 0; kind < LOCK_KIND_MAX; kind++)
+            {
+                run((enum lock_kind)kind, threads, delays[d].wait_to_obtain_us,
+                    delays[d].wait_to_release_us, duration_ms);
+            }
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+#ifndef LOCKS_H
+#define LOCKS_H
+
+/*
+ * Small lock primitives to compare against pthread_mutex_t for short
+ * critical sections.  All of them are static inline so an uncontended
+ * acquire is a handful of instructions at the call site.
+ */
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+/**
+ * Test and test-and-set spinlock: waiters spin on a plain load so the cache
+ * line stays shared until the holder releases it.
+ */
+struct spin_lock
+{
+    atomic_bool locked;
+};
+
+#define SPIN_LOCK_INITIALIZER { false }
+
+static inline void spin_lock(struct spin_lock *lock)
+{
+    while (atomic_exchange_explicit(&lock->locked, true, memory_order_acquire))
+    {
+        while (atomic_load_explicit(&lock->locked, memory_order_relaxed))
+        {
+            cpu_relax();
+        }
+    }
+}
+
+static inline void spin_unlock(struct spin_lock *lock)
+{
+    atomic_store_explicit(&lock->locked, false, memory_order_release);
+}
+
+/**
+ * Ticket lock: strict FIFO hand-off, at the price of every waiter spinning
+ * on the same now_serving line.
+ */
+struct ticket_lock
+{
+    atomic_uint next_ticket;
+    atomic_uint now_serving;
+};
+
+#define TICKET_LOCK_INITIALIZER { 0, 0 }
+
+static inline void ticket_lock(struct ticket_lock *lock)
+{
+    unsigned int ticket = atomic_fetch_add_explicit(&lock->next_ticket, 1, memory_order_relaxed);
+    while (atomic_load_explicit(&lock->now_serving, memory_order_acquire) != ticket)
+    {
+        cpu_relax();
+    }
+}
+
+static inline void ticket_unlock(struct ticket_lock *lock)
+{
+    unsigned int next = atomic_load_explicit(&lock->now_serving, memory_order_relaxed) + 1;
+    atomic_store_explicit(&lock->now_serving, next, memory_order_release);
+}
+
+/**
+ * Adaptive futex mutex (Drepper's "Futexes Are Tricky" mutex 3): state 0 is
+ * unlocked, 1 locked, 2 locked with possible sleepers.  A contended acquire
+ * spins for FUTEX_SPIN_LIMIT rounds before sleeping in the kernel, and an
+ * unlock only makes a syscall when someone may be asleep.
+ */
+struct futex_mutex
+{
+    atomic_int state;
+};
+
+#define FUTEX_MUTEX_INITIALIZER { 0 }
+#define FUTEX_SPIN_LIMIT 100
+
+static inline void futex_mutex_lock(struct futex_mutex *lock)
+{
+    int expected = 0;
+    if (atomic_compare_exchange_strong_explicit(&lock->state, &expected, 1,
+                                                memory_order_acquire, memory_order_relaxed))
+    {
+        return;
+    }
+    for (int i = 0; i < FUTEX_SPIN_LIMIT; i++)
+    {
+        cpu_relax();
+        expected = 0;
+        if (atomic_load_explicit(&lock->state, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak_explicit(&lock->state, &expected, 1,
+                                                  memory_order_acquire, memory_order_relaxed))
+        {
+            return;
+        }
+    }
+    while (atomic_exchange_explicit(&lock->state, 2, memory_order_acquire) != 0)
+    {
+        syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+    }
+}
+
+static inline void futex_mutex_unlock(struct futex_mutex *lock)
+{
+    if (atomic_exchange_explicit(&lock->state, 0, memory_order_release) == 2)
+    {
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/**
+ * MCS queue lock: each waiter spins on its own node, so a release touches
+ * only the next waiter's cache line and hand-off is FIFO.  The caller
+ * provides the node and passes the same one to mcs_unlock().
+ */
+struct mcs_node
+{
+    _Atomic(struct mcs_node *) next;
+    atomic_bool locked;
+};
+
+struct mcs_lock
+{
+    _Atomic(struct mcs_node *) tail;
+};
+
+#define MCS_LOCK_INITIALIZER { NULL }
+
+static inline void mcs_lock(struct mcs_lock *lock, struct mcs_node *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&node->locked, true, memory_order_relaxed);
+    struct mcs_node *prev = atomic_exchange_explicit(&lock->tail, node, memory_order_acq_rel);
+    if (prev == NULL)
+    {
+        return;
+    }
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+    while (atomic_load_explicit(&node->locked, memory_order_acquire))
+    {
+        cpu_relax();
+    }
+}
+
+static inline void mcs_unlock(struct mcs_lock *lock, struct mcs_node *node)
+{
+    struct mcs_node *next = atomic_load_explicit(&node->next, memory_order_acquire);
+    if (next == NULL)
+    {
+        struct mcs_node *expected = node;
+        if (atomic_compare_exchange_strong_explicit(&lock->tail, &expected, NULL,
+                                                    memory_order_release, memory_order_relaxed))
+        {
+            return;
+        }
+        /* A successor swapped itself in but hasn't linked yet */
+        while ((next = atomic_load_explicit(&node->next, memory_order_acquire)) == NULL)
+        {
+            cpu_relax();
+        }
+    }
+    atomic_store_explicit(&next->locked, false, memory_order_release);
+}
+
+#endif /* LOCKS_H */
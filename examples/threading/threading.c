@@ -13,7 +13,7 @@ void* threadfunc(void* thread_param)
     struct thread_data* thread_func_args = (struct thread_data *) thread_param;
     
    // Wait before obtaining the mutex 
-   usleep(thread_func_args->wait_to_obtain_ms * 1000); 
+   usleep((useconds_t)thread_func_args->wait_to_obtain_ms * 1000); 
    
    // Obtain the mutex 
    if (pthread_mutex_lock(thread_func_args->mutex) != 0) 
@@ -26,7 +26,7 @@ void* threadfunc(void* thread_param)
    DEBUG_LOG("Mutex obtained");
 
     // Wait while holding the mutex
-    usleep(thread_func_args->wait_to_release_ms * 1000);
+    usleep((useconds_t)thread_func_args->wait_to_release_ms * 1000);
 
     // Release the mutex
     if (pthread_mutex_unlock(thread_func_args->mutex) != 0) {
@@ -0,0 +1,175 @@
+/**
+ * @file threadpool-bench.c
+ * @brief Tasks per second through the thread pool against a thread per task
+ *
+ * Usage: threadpool-bench [tasks] [workers] [work_iterations]
+ * Each task spins for work_iterations iterations of a small integer hash, so
+ * the cost of starting the task dominates for small values.  Four ways of
+ * running the same tasks are timed:
+ *  - thread per task: pthread_create() + pthread_join() in waves of [workers]
+ *  - threadpool_submit() + threadpool_future_get() from outside the pool
+ *  - threadpool_post() from outside the pool, waiting on a counter
+ *  - fan-out from inside a task, which lands on the worker's own deque and
+ *    is spread by stealing
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+static unsigned long work_iterations = 100;
+static atomic_ulong completed;
+static atomic_ulong sink;
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *work(void *arg)
+{
+    unsigned long x = (unsigned long)(uintptr_t)arg;
+    for (unsigned long i = 0; i < work_iterations; i++)
+    {
+        x = x * 6364136223846793005ul + 1442695040888963407ul;
+    }
+    atomic_fetch_add_explicit(&sink, x, memory_order_relaxed);
+    atomic_fetch_add_explicit(&completed, 1, memory_order_relaxed);
+    return NULL;
+}
+
+static void wait_completed(unsigned long tasks)
+{
+    while (atomic_load(&completed) < tasks)
+    {
+        sched_yield();
+    }
+}
+
+static double bench_thread_per_task(unsigned long tasks, unsigned int workers)
+{
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    double start = now_s();
+    for (unsigned long done = 0; done < tasks; done += workers)
+    {
+        unsigned int wave = tasks - done < workers ? tasks - done : workers;
+        for (unsigned int i = 0; i < wave; i++)
+        {
+            if (pthread_create(&threads[i], NULL, work, (void *)(uintptr_t)(done + i)) != 0)
+            {
+                perror("pthread_create");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (unsigned int i = 0; i < wave; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+    free(threads);
+    return tasks / (now_s() - start);
+}
+
+static double bench_submit(struct threadpool *pool, unsigned long tasks)
+{
+    struct threadpool_future **futures = malloc(tasks * sizeof(*futures));
+    double start = now_s();
+    for (unsigned long i = 0; i < tasks; i++)
+    {
+        while ((futures[i] = threadpool_submit(pool, work, (void *)(uintptr_t)i)) == NULL)
+        {
+            sched_yield();
+        }
+    }
+    for (unsigned long i = 0; i < tasks; i++)
+    {
+        threadpool_future_get(futures[i]);
+    }
+    double rate = tasks / (now_s() - start);
+    free(futures);
+    return rate;
+}
+
+static double bench_post(struct threadpool *pool, unsigned long tasks)
+{
+    atomic_store(&completed, 0);
+    double start = now_s();
+    for (unsigned long i = 0; i < tasks; i++)
+    {
+        while (!threadpool_post(pool, work, (void *)(uintptr_t)i))
+        {
+            sched_yield();
+        }
+    }
+    wait_completed(tasks);
+    return tasks / (now_s() - start);
+}
+
+struct fan_out
+{
+    struct threadpool *pool;
+    unsigned long tasks;
+};
+
+/*
+ * Runs on a worker, so every post goes to that worker's deque.  Waiting for
+ * room here could wait forever with a single worker, so a task that doesn't
+ * fit runs inline instead.
+ */
+static void *fan_out_task(void *arg)
+{
+    struct fan_out *fan = (struct fan_out *)arg;
+    for (unsigned long i = 0; i < fan->tasks; i++)
+    {
+        if (!threadpool_post(fan->pool, work, (void *)(uintptr_t)i))
+        {
+            work((void *)(uintptr_t)i);
+        }
+    }
+    return NULL;
+}
+
+static double bench_fan_out(struct threadpool *pool, unsigned long tasks)
+{
+    struct fan_out fan = { pool, tasks };
+    atomic_store(&completed, 0);
+    double start = now_s();
+    threadpool_future_get(threadpool_submit(pool, fan_out_task, &fan));
+    wait_completed(tasks);
+    return tasks / (now_s() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long tasks = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int workers = argc > 2 ? strtoul(argv[2], NULL, 10) : (cpus > 0 ? cpus : 1);
+    if (argc > 3)
+    {
+        work_iterations = strtoul(argv[3], NULL, 10);
+    }
+    if (workers == 0)
+    {
+        workers = 1;
+    }
+
+    struct threadpool *pool = threadpool_create(workers, 4096);
+    if (pool == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    printf("%lu tasks, %u workers, %lu iterations per task\n", tasks, workers, work_iterations);
+    printf("%-24s %14.0f tasks/s\n", "thread per task", bench_thread_per_task(tasks, workers));
+    printf("%-24s %14.0f tasks/s\n", "pool submit + get", bench_submit(pool, tasks));
+    printf("%-24s %14.0f tasks/s\n", "pool post", bench_post(pool, tasks));
+    printf("%-24s %14.0f tasks/s\n", "pool fan-out (stealing)", bench_fan_out(pool, tasks));
+
+    threadpool_destroy(pool);
+    return EXIT_SUCCESS;
+}
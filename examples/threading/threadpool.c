@@ -0,0 +1,441 @@
+#include "threadpool.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ERROR_LOG(msg,...) printf("threadpool ERROR: " msg "\n" , ##__VA_ARGS__)
+
+/* Capacity of each worker's deque; a full deque spills into the shared queue */
+#define DEQUE_SIZE 256
+
+struct mpmc_cell
+{
+    atomic_size_t sequence;
+    void *item;
+};
+
+struct threadpool_task
+{
+    threadpool_fn fn;
+    void *arg;
+    /* NULL for tasks started with threadpool_post() */
+    struct threadpool_future *future;
+};
+
+struct threadpool_future
+{
+    struct threadpool_task task;
+    void *result;
+    bool done;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+/**
+ * Fixed size Chase-Lev work-stealing deque.  The owning worker pushes and
+ * takes at the bottom (newest first, while its data is still cache hot);
+ * other workers steal from the top (oldest first).
+ */
+struct ws_deque
+{
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    _Atomic(struct threadpool_task *) tasks[DEQUE_SIZE];
+};
+
+struct worker
+{
+    struct threadpool *pool;
+    unsigned int index;
+    pthread_t thread;
+    struct ws_deque deque;
+};
+
+struct threadpool
+{
+    struct worker *workers;
+    unsigned int num_workers;
+    /* Worker threads actually running, joined by threadpool_destroy() */
+    unsigned int started;
+    struct mpmc_queue queue;
+    /* Tasks queued anywhere and not yet picked up by a worker */
+    atomic_long pending;
+    atomic_uint idle;
+    atomic_bool shutdown;
+    pthread_mutex_t idle_mutex;
+    pthread_cond_t idle_cond;
+};
+
+static __thread struct worker *current_worker;
+
+bool mpmc_queue_init(struct mpmc_queue *queue, size_t capacity)
+{
+    size_t size = 2;
+    while (size < capacity)
+    {
+        size *= 2;
+    }
+    queue->cells = malloc(size * sizeof(struct mpmc_cell));
+    if (queue->cells == NULL)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < size; i++)
+    {
+        atomic_init(&queue->cells[i].sequence, i);
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->enqueue_pos, 0);
+    atomic_init(&queue->dequeue_pos, 0);
+    return true;
+}
+
+void mpmc_queue_destroy(struct mpmc_queue *queue)
+{
+    free(queue->cells);
+    queue->cells = NULL;
+}
+
+bool mpmc_queue_push(struct mpmc_queue *queue, void *item)
+{
+    size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    struct mpmc_cell *cell;
+    while (1)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* The consumer of the previous lap hasn't freed this cell: full */
+            return false;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    cell->item = item;
+    atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+void *mpmc_queue_pop(struct mpmc_queue *queue)
+{
+    size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    struct mpmc_cell *cell;
+    while (1)
+    {
+        cell = &queue->cells[pos & queue->mask];
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return NULL;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    void *item = cell->item;
+    atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+    return item;
+}
+
+static bool deque_push(struct ws_deque *deque, struct threadpool_task *task)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t >= DEQUE_SIZE)
+    {
+        return false;
+    }
+    atomic_store_explicit(&deque->tasks[b % DEQUE_SIZE], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+static struct threadpool_task *deque_take(struct ws_deque *deque)
+{
+    long b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    struct threadpool_task *task = NULL;
+    if (t <= b)
+    {
+        task = atomic_load_explicit(&deque->tasks[b % DEQUE_SIZE], memory_order_relaxed);
+        if (t == b)
+        {
+            /* Last task: race the thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+                                                         memory_order_seq_cst,
+                                                         memory_order_relaxed))
+            {
+                task = NULL;
+            }
+            atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        }
+    }
+    else
+    {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+static struct threadpool_task *deque_steal(struct ws_deque *deque)
+{
+    long t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b)
+    {
+        return NULL;
+    }
+    struct threadpool_task *task = atomic_load_explicit(&deque->tasks[t % DEQUE_SIZE],
+                                                        memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed))
+    {
+        return NULL;
+    }
+    return task;
+}
+
+/**
+ * Find the next task for @param self: its own deque first, then the shared
+ * queue, then the deques of the other workers.
+ */
+static struct threadpool_task *find_task(struct worker *self)
+{
+    struct threadpool *pool = self->pool;
+    struct threadpool_task *task = deque_take(&self->deque);
+    if (task == NULL)
+    {
+        task = mpmc_queue_pop(&pool->queue);
+    }
+    for (unsigned int i = 1; task == NULL && i < pool->num_workers; i++)
+    {
+        task = deque_steal(&pool->workers[(self->index + i) % pool->num_workers].deque);
+    }
+    if (task != NULL)
+    {
+        atomic_fetch_sub(&pool->pending, 1);
+    }
+    return task;
+}
+
+static void run_task(struct threadpool_task *task)
+{
+    void *result = task->fn(task->arg);
+    struct threadpool_future *future = task->future;
+    if (future == NULL)
+    {
+        free(task);
+        return;
+    }
+    pthread_mutex_lock(&future->mutex);
+    future->result = result;
+    future->done = true;
+    pthread_cond_signal(&future->cond);
+    pthread_mutex_unlock(&future->mutex);
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *self = (struct worker *)arg;
+    struct threadpool *pool = self->pool;
+    current_worker = self;
+
+    while (1)
+    {
+        struct threadpool_task *task = find_task(self);
+        if (task != NULL)
+        {
+            run_task(task);
+            continue;
+        }
+
+        /*
+         * Nothing to do.  idle is raised before pending is checked, and a
+         * submitter raises pending before checking idle, so either this
+         * worker sees the new task or the submitter sees this worker idle
+         * and signals it.
+         */
+        pthread_mutex_lock(&pool->idle_mutex);
+        atomic_fetch_add(&pool->idle, 1);
+        while (atomic_load(&pool->pending) == 0 && !atomic_load(&pool->shutdown))
+        {
+            pthread_cond_wait(&pool->idle_cond, &pool->idle_mutex);
+        }
+        atomic_fetch_sub(&pool->idle, 1);
+        bool stop = atomic_load(&pool->pending) == 0 && atomic_load(&pool->shutdown);
+        pthread_mutex_unlock(&pool->idle_mutex);
+        if (stop)
+        {
+            break;
+        }
+    }
+    return NULL;
+}
+
+static bool enqueue_task(struct threadpool *pool, struct threadpool_task *task)
+{
+    struct worker *self = current_worker;
+    atomic_fetch_add(&pool->pending, 1);
+    if ((self == NULL || self->pool != pool || !deque_push(&self->deque, task)) &&
+        !mpmc_queue_push(&pool->queue, task))
+    {
+        atomic_fetch_sub(&pool->pending, 1);
+        errno = EAGAIN;
+        return false;
+    }
+    if (atomic_load(&pool->idle) > 0)
+    {
+        pthread_mutex_lock(&pool->idle_mutex);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->idle_mutex);
+    }
+    return true;
+}
+
+struct threadpool *threadpool_create(unsigned int workers, size_t queue_capacity)
+{
+    if (workers == 0)
+    {
+        workers = 1;
+    }
+    struct threadpool *pool = calloc(1, sizeof(struct threadpool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    /* struct worker is a multiple of the 64 byte cache line because of its deque */
+    pool->workers = aligned_alloc(64, workers * sizeof(struct worker));
+    if (pool->workers == NULL || !mpmc_queue_init(&pool->queue, queue_capacity))
+    {
+        ERROR_LOG("Failed to allocate the pool");
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->idle_mutex, NULL);
+    pthread_cond_init(&pool->idle_cond, NULL);
+
+    pool->num_workers = workers;
+    for (unsigned int i = 0; i < workers; i++)
+    {
+        struct worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->index = i;
+        atomic_init(&w->deque.top, 0);
+        atomic_init(&w->deque.bottom, 0);
+    }
+    for (unsigned int i = 0; i < workers; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0)
+        {
+            ERROR_LOG("Failed to create worker %u", i);
+            threadpool_destroy(pool);
+            return NULL;
+        }
+        pool->started++;
+    }
+    return pool;
+}
+
+bool threadpool_post(struct threadpool *pool, threadpool_fn fn, void *arg)
+{
+    struct threadpool_task *task = malloc(sizeof(struct threadpool_task));
+    if (task == NULL)
+    {
+        return false;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->future = NULL;
+    if (!enqueue_task(pool, task))
+    {
+        free(task);
+        return false;
+    }
+    return true;
+}
+
+struct threadpool_future *threadpool_submit(struct threadpool *pool, threadpool_fn fn, void *arg)
+{
+    struct threadpool_future *future = malloc(sizeof(struct threadpool_future));
+    if (future == NULL)
+    {
+        return NULL;
+    }
+    future->task.fn = fn;
+    future->task.arg = arg;
+    future->task.future = future;
+    future->result = NULL;
+    future->done = false;
+    pthread_mutex_init(&future->mutex, NULL);
+    pthread_cond_init(&future->cond, NULL);
+    if (!enqueue_task(pool, &future->task))
+    {
+        pthread_mutex_destroy(&future->mutex);
+        pthread_cond_destroy(&future->cond);
+        free(future);
+        return NULL;
+    }
+    return future;
+}
+
+void *threadpool_future_get(struct threadpool_future *future)
+{
+    pthread_mutex_lock(&future->mutex);
+    while (!future->done)
+    {
+        pthread_cond_wait(&future->cond, &future->mutex);
+    }
+    pthread_mutex_unlock(&future->mutex);
+
+    void *result = future->result;
+    pthread_mutex_destroy(&future->mutex);
+    pthread_cond_destroy(&future->cond);
+    free(future);
+    return result;
+}
+
+void threadpool_destroy(struct threadpool *pool)
+{
+    pthread_mutex_lock(&pool->idle_mutex);
+    atomic_store(&pool->shutdown, true);
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->idle_mutex);
+
+    for (unsigned int i = 0; i < pool->started; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    mpmc_queue_destroy(&pool->queue);
+    pthread_mutex_destroy(&pool->idle_mutex);
+    pthread_cond_destroy(&pool->idle_cond);
+    free(pool->workers);
+    free(pool);
+}
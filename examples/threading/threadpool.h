@@ -0,0 +1,83 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+typedef void *(*threadpool_fn)(void *arg);
+
+struct threadpool_task;
+
+/**
+ * Bounded multi-producer multi-consumer queue of task pointers (Dmitry
+ * Vyukov's array queue): every cell carries a sequence number telling
+ * producers and consumers whose turn it is, so neither side takes a lock.
+ */
+struct mpmc_queue
+{
+    struct mpmc_cell *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t enqueue_pos;
+    _Alignas(64) atomic_size_t dequeue_pos;
+};
+
+/**
+* Initialise @param queue to hold up to @param capacity entries, rounded up to a power of two.
+* @return true on success, false if the memory could not be allocated.
+*/
+bool mpmc_queue_init(struct mpmc_queue *queue, size_t capacity);
+void mpmc_queue_destroy(struct mpmc_queue *queue);
+
+/**
+* @return true if @param item was queued, false if the queue is full.
+*/
+bool mpmc_queue_push(struct mpmc_queue *queue, void *item);
+
+/**
+* @return the oldest item, or NULL if the queue is empty.
+*/
+void *mpmc_queue_pop(struct mpmc_queue *queue);
+
+/**
+ * Result of a task started with threadpool_submit(), collected with
+ * threadpool_future_get().
+ */
+struct threadpool_future;
+
+struct threadpool;
+
+/**
+* Start a pool of @param workers threads.  Tasks submitted from outside the pool go through a
+* bounded queue of @param queue_capacity entries; tasks submitted by a running task go to the
+* submitting worker's own deque, from which idle workers steal.
+* @return the pool, or NULL if it could not be created.
+*/
+struct threadpool *threadpool_create(unsigned int workers, size_t queue_capacity);
+
+/**
+* Run @param fn(@param arg) on the pool without collecting its result.
+* @return true if the task was queued, false if the queue is full (errno EAGAIN) or out of memory.
+*/
+bool threadpool_post(struct threadpool *pool, threadpool_fn fn, void *arg);
+
+/**
+* Run @param fn(@param arg) on the pool.
+* @return a future to pass to threadpool_future_get(), or NULL as for threadpool_post().
+*/
+struct threadpool_future *threadpool_submit(struct threadpool *pool, threadpool_fn fn, void *arg);
+
+/**
+* Wait for the task behind @param future and free the future.
+* @return the value returned by the task.
+*/
+void *threadpool_future_get(struct threadpool_future *future);
+
+/**
+* Run every task already queued, then stop and join the workers and free @param pool.
+*/
+void threadpool_destroy(struct threadpool *pool);
+
+#endif /* THREADPOOL_H */
@@ -0,0 +1,69 @@
+/*
+ * find.h
+ *
+ * Vectorised fixed-string search shared by finder and aesdsocket's filtered
+ * read-back.
+ */
+
+#ifndef FIND_H
+#define FIND_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t v16u8 __attribute__((vector_size(16)));
+
+static inline v16u8 load16(const char *p) {
+    v16u8 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline v16u8 splat16(uint8_t c) {
+    return (v16u8){ c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c };
+}
+
+/**
+ * Find the @param len bytes at @param pattern, at least one, in
+ * [@param hay, @param end).  Sixteen candidate positions are tested at once
+ * by comparing the first and the last pattern byte against two shifted loads
+ * of the haystack; only the positions where both match are checked with
+ * memcmp().  Written with GCC vector extensions, so it compiles to SSE2, NEON
+ * or plain integer code as the target allows.
+ * @return pointer to the first match, or NULL.
+ */
+static inline const char *find(const char *hay, const char *end, const char *pattern,
+                               size_t len) {
+    if ((size_t)(end - hay) < len) {
+        return NULL;
+    }
+    if (len == 1) {
+        return memchr(hay, pattern[0], end - hay);
+    }
+
+    const v16u8 first = splat16((uint8_t)pattern[0]);
+    const v16u8 last = splat16((uint8_t)pattern[len - 1]);
+    const char *p = hay;
+    for (; p + len - 1 + 16 <= end; p += 16) {
+        v16u8 hits = (v16u8)((load16(p) == first) & (load16(p + len - 1) == last));
+        uint64_t any[2];
+        memcpy(any, &hits, sizeof(any));
+        if ((any[0] | any[1]) == 0) {
+            continue;
+        }
+        for (int lane = 0; lane < 16; lane++) {
+            if (hits[lane] && memcmp(p + lane + 1, pattern + 1, len - 2) == 0) {
+                return p + lane;
+            }
+        }
+    }
+    for (; p + len <= end; p++) {
+        if (p[0] == pattern[0] && memcmp(p, pattern, len) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#endif /* FIND_H */
@@ -49,10 +49,8 @@ then
 	fi
 fi
 
-for i in $( seq 1 $NUMFILES)
-do
-	./writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+# One writer process creates all the files
+./writer -n "$NUMFILES" -t "${username}%u.txt" "$WRITEDIR" "$WRITESTR"
 
 OUTPUTSTRING=$(./finder.sh "$WRITEDIR" "$WRITESTR")
 
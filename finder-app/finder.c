@@ -0,0 +1,688 @@
+/*
+ * finder: count the files under a directory containing a string, and the
+ * lines containing it, in a single pass.
+ *
+ * Usage: finder [-i index] <filesdir> <searchstr>
+ *        finder -w -i index <filesdir>
+ * Prints "The number of files are X and the number of matching lines are Y",
+ * like finder.sh.  The tree is walked once with openat()/getdents64(); every
+ * regular file is opened by the walker and its descriptor handed to a thread
+ * pool, which searches it with a vectorised substring search.
+ *
+ * With -i, a trigram Bloom filter of every file is kept in the index file,
+ * keyed by inode, size and mtime.  The walk still stats every file, but only
+ * files that changed since the index was written are read to rebuild their
+ * filter, and of the rest only those whose filter may contain every trigram
+ * of searchstr are read at all.  With -w, finder keeps the index up to date
+ * as inotify reports changes under filesdir, until it is killed.
+ *
+ * Unlike the grep pipeline in finder.sh, searchstr is matched as a fixed
+ * string, not a regular expression, and symbolic links are not followed.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "../examples/threading/threadpool.h"
+#include "find.h"
+
+#define DIRENT_BUF_SIZE 32768
+/* Files up to this size are read() into a per-thread buffer, larger ones mmap()ed */
+#define READ_LIMIT (256 * 1024)
+#define POOL_QUEUE_SIZE 256
+
+#define INDEX_MAGIC 0x58444946u /* "FIDX" */
+#define INDEX_VERSION 1
+/* Bloom filters get half a byte per file byte, within these bounds */
+#define BLOOM_MIN_BYTES 32
+#define BLOOM_MAX_BYTES 8192
+/* Quiet time after an inotify event before the index is brought up to date */
+#define WATCH_SETTLE_MS 200
+
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*
+ * One file in the index.  The walker creates or reuses an entry for every
+ * regular file it finds; a pool task fills in bloom when the file is new or
+ * has changed.
+ */
+struct index_entry {
+    char *path;
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t bloom_bytes;
+    uint8_t *bloom;
+    int fd;
+    int seen;
+    struct index_entry *next;
+};
+
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint32_t root_len;
+    uint32_t reserved;
+};
+
+struct index_record {
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t bloom_bytes;
+    uint32_t path_len;
+};
+
+/* Entries loaded from the index file, looked up by relative path */
+struct file_index {
+    struct index_entry **entries;
+    size_t count;
+    struct index_entry **table;
+    size_t mask;
+};
+
+static const char *needle;
+static size_t needle_len;
+static struct threadpool *pool;
+static atomic_ulong matching_files;
+static atomic_ulong matching_lines;
+static __thread char *read_buffer;
+
+static const char *index_path;
+static char root_path[PATH_MAX];
+static struct file_index old_index;
+static struct index_entry *new_entries;
+static struct index_entry **new_tail = &new_entries;
+static size_t new_count;
+static int index_dirty;
+static int inotify_fd = -1;
+
+/**
+ * @return the number of lines in [@param data, @param data + @param len)
+ * containing the needle, each line counted once as grep -c does.
+ */
+static unsigned long count_matching_lines(const char *data, size_t len) {
+    const char *end = data + len;
+    const char *p = data;
+    unsigned long lines = 0;
+
+    if (needle_len == 0) {
+        /* An empty pattern matches every line, including an unterminated last one */
+        while (p < end) {
+            const char *newline = memchr(p, '\n', end - p);
+            lines++;
+            p = newline ? newline + 1 : end;
+        }
+        return lines;
+    }
+
+    while ((p = find(p, end, needle, needle_len)) != NULL) {
+        lines++;
+        const char *newline = memchr(p + needle_len - 1, '\n', end - (p + needle_len - 1));
+        if (newline == NULL) {
+            break;
+        }
+        p = newline + 1;
+    }
+    return lines;
+}
+
+/*
+ * Trigram Bloom filter with two hash functions.  bloom_bytes is a power of
+ * two so the bit index is a mask of each hash.
+ */
+static inline void bloom_bits(const uint8_t *p, uint32_t mask, uint32_t *h1, uint32_t *h2) {
+    uint32_t trigram = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    *h1 = (trigram * 0x9e3779b1u >> 8) & mask;
+    *h2 = (trigram * 0x85ebca77u >> 8) & mask;
+}
+
+static void bloom_build(struct index_entry *entry, const char *data, size_t len) {
+    uint32_t bytes = BLOOM_MIN_BYTES;
+    while (bytes < BLOOM_MAX_BYTES && bytes < len / 2) {
+        bytes *= 2;
+    }
+    entry->bloom = calloc(1, bytes);
+    if (entry->bloom == NULL) {
+        return;
+    }
+    entry->bloom_bytes = bytes;
+
+    uint32_t mask = bytes * 8 - 1, h1, h2;
+    for (size_t i = 0; i + 3 <= len; i++) {
+        bloom_bits((const uint8_t *)data + i, mask, &h1, &h2);
+        entry->bloom[h1 / 8] |= 1u << (h1 % 8);
+        entry->bloom[h2 / 8] |= 1u << (h2 % 8);
+    }
+}
+
+/**
+ * @return false if the file behind @param entry certainly doesn't contain the needle.
+ * Needles shorter than a trigram can't be ruled out.
+ */
+static int bloom_may_contain(const struct index_entry *entry) {
+    uint32_t mask = entry->bloom_bytes * 8 - 1, h1, h2;
+    for (size_t i = 0; i + 3 <= needle_len; i++) {
+        bloom_bits((const uint8_t *)needle + i, mask, &h1, &h2);
+        if (!(entry->bloom[h1 / 8] & (1u << (h1 % 8))) ||
+            !(entry->bloom[h2 / 8] & (1u << (h2 % 8)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline uint64_t stat_mtime_ns(const struct stat *st) {
+    return (uint64_t)st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec;
+}
+
+/**
+ * Search the file open on @param fd (which this function closes).  With an
+ * index @param entry whose filter is missing, the filter and the entry's keys
+ * are rebuilt from the same read.
+ */
+static void search_fd(int fd, struct index_entry *entry) {
+    struct stat st;
+    const char *data = NULL;
+    size_t len = 0;
+    void *mapped = NULL;
+    unsigned long lines = 0;
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+    } else if (st.st_size > READ_LIMIT) {
+        mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            perror("mmap");
+            mapped = NULL;
+        } else {
+            madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+            data = mapped;
+            len = st.st_size;
+        }
+    } else {
+        if (read_buffer == NULL) {
+            /* Lives as long as the worker thread */
+            read_buffer = malloc(READ_LIMIT);
+        }
+        ssize_t n;
+        while (read_buffer != NULL && len < READ_LIMIT &&
+               ((n = read(fd, read_buffer + len, READ_LIMIT - len)) > 0 ||
+                (n == -1 && errno == EINTR))) {
+            len += n > 0 ? n : 0;
+        }
+        data = read_buffer;
+    }
+
+    if (data != NULL) {
+        if (entry != NULL && entry->bloom == NULL) {
+            entry->ino = st.st_ino;
+            entry->size = st.st_size;
+            entry->mtime_ns = stat_mtime_ns(&st);
+            bloom_build(entry, data, len);
+        }
+        if (needle != NULL) {
+            lines = count_matching_lines(data, len);
+        }
+    }
+    if (mapped != NULL) {
+        munmap(mapped, st.st_size);
+    }
+    close(fd);
+
+    if (lines > 0) {
+        atomic_fetch_add_explicit(&matching_files, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&matching_lines, lines, memory_order_relaxed);
+    }
+}
+
+static void *search_file(void *arg) {
+    search_fd((int)(intptr_t)arg, NULL);
+    return NULL;
+}
+
+static void *search_indexed_file(void *arg) {
+    struct index_entry *entry = (struct index_entry *)arg;
+    search_fd(entry->fd, entry);
+    return NULL;
+}
+
+static size_t path_hash(const char *path) {
+    size_t hash = 14695981039346656037ull;
+    for (; *path; path++) {
+        hash = (hash ^ (unsigned char)*path) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static struct index_entry *index_lookup(const char *path) {
+    if (old_index.table == NULL) {
+        return NULL;
+    }
+    for (size_t i = path_hash(path) & old_index.mask; old_index.table[i] != NULL;
+         i = (i + 1) & old_index.mask) {
+        if (strcmp(old_index.table[i]->path, path) == 0) {
+            return old_index.table[i];
+        }
+    }
+    return NULL;
+}
+
+static void index_entry_free(struct index_entry *entry) {
+    free(entry->path);
+    free(entry->bloom);
+    free(entry);
+}
+
+/**
+ * Make @param entries (a list of @param count) the index the next walk is
+ * compared against, freeing the entries of the previous one it didn't see.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int index_set(struct index_entry *entries, size_t count) {
+    for (size_t i = 0; i < old_index.count; i++) {
+        if (!old_index.entries[i]->seen) {
+            index_entry_free(old_index.entries[i]);
+        }
+    }
+    free(old_index.entries);
+    free(old_index.table);
+    memset(&old_index, 0, sizeof(old_index));
+
+    size_t size = 16;
+    while (size < count * 2) {
+        size *= 2;
+    }
+    old_index.entries = malloc((count ? count : 1) * sizeof(*old_index.entries));
+    old_index.table = calloc(size, sizeof(*old_index.table));
+    if (old_index.entries == NULL || old_index.table == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    old_index.mask = size - 1;
+    for (struct index_entry *entry = entries; entry != NULL; entry = entry->next) {
+        entry->seen = 0;
+        old_index.entries[old_index.count++] = entry;
+        size_t i = path_hash(entry->path) & old_index.mask;
+        while (old_index.table[i] != NULL) {
+            i = (i + 1) & old_index.mask;
+        }
+        old_index.table[i] = entry;
+    }
+    return 0;
+}
+
+/**
+ * Load the index at index_path if it was built for root_path.  A missing,
+ * stale or damaged index file is not an error: every file is simply
+ * reindexed.
+ */
+static void index_load(void) {
+    struct index_entry *entries = NULL, **tail = &entries;
+    size_t count = 0;
+    struct index_header header;
+    char root[PATH_MAX];
+
+    FILE *file = fopen(index_path, "rb");
+    if (file == NULL) {
+        if (errno != ENOENT) {
+            perror(index_path);
+        }
+        index_set(NULL, 0);
+        return;
+    }
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != INDEX_MAGIC ||
+        header.version != INDEX_VERSION || header.root_len >= sizeof(root) ||
+        fread(root, 1, header.root_len, file) != header.root_len) {
+        header.count = 0;
+    } else {
+        root[header.root_len] = '\0';
+        if (strcmp(root, root_path) != 0) {
+            header.count = 0;
+        }
+    }
+
+    for (uint64_t i = 0; i < header.count; i++) {
+        struct index_record record;
+        struct index_entry *entry;
+        if (fread(&record, sizeof(record), 1, file) != 1 || record.path_len >= PATH_MAX ||
+            record.bloom_bytes < BLOOM_MIN_BYTES || record.bloom_bytes > BLOOM_MAX_BYTES ||
+            (record.bloom_bytes & (record.bloom_bytes - 1)) != 0 ||
+            (entry = calloc(1, sizeof(*entry))) == NULL) {
+            break;
+        }
+        entry->path = malloc(record.path_len + 1);
+        entry->bloom = malloc(record.bloom_bytes);
+        if (entry->path == NULL || entry->bloom == NULL ||
+            fread(entry->path, 1, record.path_len, file) != record.path_len ||
+            fread(entry->bloom, 1, record.bloom_bytes, file) != record.bloom_bytes) {
+            index_entry_free(entry);
+            break;
+        }
+        entry->path[record.path_len] = '\0';
+        entry->ino = record.ino;
+        entry->size = record.size;
+        entry->mtime_ns = record.mtime_ns;
+        entry->bloom_bytes = record.bloom_bytes;
+        *tail = entry;
+        tail = &entry->next;
+        count++;
+    }
+    fclose(file);
+    /* Anything short of the whole file counts as a change, so it gets rewritten */
+    index_dirty = count != header.count;
+    index_set(entries, count);
+}
+
+/**
+ * Write the entries collected by the last walk to index_path, through a
+ * temporary file renamed over it so a reader never sees half an index.
+ */
+static int index_save(void) {
+    char tmp_path[PATH_MAX];
+    struct index_header header = { INDEX_MAGIC, INDEX_VERSION, 0, strlen(root_path), 0 };
+
+    for (struct index_entry *entry = new_entries; entry != NULL; entry = entry->next) {
+        header.count += entry->bloom != NULL;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", index_path);
+    FILE *file = fopen(tmp_path, "wb");
+    if (file == NULL) {
+        perror(tmp_path);
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(root_path, 1, header.root_len, file);
+    for (struct index_entry *entry = new_entries; entry != NULL; entry = entry->next) {
+        /* Files that couldn't be read are left out, and retried next time */
+        if (entry->bloom == NULL) {
+            continue;
+        }
+        struct index_record record = {
+            entry->ino, entry->size, entry->mtime_ns, entry->bloom_bytes, strlen(entry->path),
+        };
+        fwrite(&record, sizeof(record), 1, file);
+        fwrite(entry->path, 1, record.path_len, file);
+        fwrite(entry->bloom, 1, entry->bloom_bytes, file);
+    }
+    if (ferror(file) | fclose(file) || rename(tmp_path, index_path) == -1) {
+        perror(index_path);
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Index mode: find or create the entry for the file @param path (relative
+ * to the root) named @param name in @param dir_fd, and search it if it may
+ * contain the needle or has to be reindexed.
+ */
+static void visit_indexed_file(int dir_fd, const char *name, const char *path) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+
+    struct index_entry *entry = index_lookup(path);
+    if (entry != NULL && !entry->seen && entry->ino == (uint64_t)st.st_ino &&
+        entry->size == (uint64_t)st.st_size && entry->mtime_ns == stat_mtime_ns(&st)) {
+        entry->seen = 1;
+        entry->next = NULL;
+        *new_tail = entry;
+        new_tail = &entry->next;
+        new_count++;
+        if (needle == NULL || !bloom_may_contain(entry)) {
+            return;
+        }
+    } else {
+        entry = calloc(1, sizeof(*entry));
+        if (entry == NULL || (entry->path = strdup(path)) == NULL) {
+            perror("malloc");
+            free(entry);
+            return;
+        }
+        *new_tail = entry;
+        new_tail = &entry->next;
+        new_count++;
+        index_dirty = 1;
+    }
+
+    entry->fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (entry->fd == -1) {
+        return;
+    }
+    if (!threadpool_post(pool, search_indexed_file, entry)) {
+        search_indexed_file(entry);
+    }
+}
+
+/**
+ * Walk the directory open on @param dir_fd (which this function closes),
+ * handing every regular file to the pool.  In index mode, @param path holds
+ * the directory's path relative to the root in its first @param path_len
+ * bytes, with a trailing '/' unless it is the root.
+ */
+static void walk(int dir_fd, char *path, size_t path_len) {
+    char *buf = malloc(DIRENT_BUF_SIZE);
+    if (buf == NULL) {
+        perror("malloc");
+        close(dir_fd);
+        return;
+    }
+
+    if (inotify_fd != -1) {
+        char watch_path[PATH_MAX * 2];
+        snprintf(watch_path, sizeof(watch_path), "%s/%.*s", root_path, (int)path_len, path);
+        if (inotify_add_watch(inotify_fd, watch_path, IN_CREATE | IN_DELETE | IN_CLOSE_WRITE |
+                              IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR) == -1) {
+            perror("inotify_add_watch");
+        }
+    }
+
+    long nread;
+    while ((nread = syscall(SYS_getdents64, dir_fd, buf, DIRENT_BUF_SIZE)) > 0) {
+        for (long pos = 0; pos < nread;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+            pos += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+                continue;
+            }
+
+            size_t name_len = strlen(d->d_name);
+            if (index_path != NULL) {
+                if (path_len + name_len + 2 > PATH_MAX) {
+                    continue;
+                }
+                memcpy(path + path_len, d->d_name, name_len + 1);
+            }
+
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dir_fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    continue;
+                }
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                int child = openat(dir_fd, d->d_name,
+                                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (child != -1) {
+                    if (index_path != NULL) {
+                        path[path_len + name_len] = '/';
+                    }
+                    walk(child, path, path_len + name_len + 1);
+                }
+            } else if (type == DT_REG && index_path != NULL) {
+                visit_indexed_file(dir_fd, d->d_name, path);
+            } else if (type == DT_REG) {
+                int fd = openat(dir_fd, d->d_name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd == -1) {
+                    continue;
+                }
+                /* A full queue means the workers are behind: search this one here */
+                if (!threadpool_post(pool, search_file, (void *)(intptr_t)fd)) {
+                    search_file((void *)(intptr_t)fd);
+                }
+            }
+        }
+    }
+    if (nread == -1) {
+        perror("getdents64");
+    }
+    free(buf);
+    close(dir_fd);
+}
+
+/**
+ * Walk the whole tree once, searching it and, in index mode, bringing the
+ * index file up to date.
+ * @return 0 on success, -1 on error.
+ */
+static int run(void) {
+    char path[PATH_MAX];
+
+    int dir_fd = open(root_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1) {
+        fprintf(stderr, "Error: 'filsdir' does not represent a directory in filesystem\n");
+        return -1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pool = threadpool_create(cpus > 0 ? cpus : 1, POOL_QUEUE_SIZE);
+    if (pool == NULL) {
+        close(dir_fd);
+        return -1;
+    }
+    walk(dir_fd, path, 0);
+    threadpool_destroy(pool);
+
+    if (index_path == NULL) {
+        return 0;
+    }
+    /* Files that went away since the last walk change the index too */
+    int status = 0;
+    if (index_dirty || new_count != old_index.count) {
+        status = index_save();
+    }
+    struct index_entry *entries = new_entries;
+    size_t count = new_count;
+    new_entries = NULL;
+    new_tail = &new_entries;
+    new_count = 0;
+    index_dirty = 0;
+    if (index_set(entries, count) == -1) {
+        return -1;
+    }
+    return status;
+}
+
+/**
+ * Watch mode: rewalk the tree whenever inotify reports a change, once
+ * changes have stopped for WATCH_SETTLE_MS.  Only changed files are read.
+ */
+static int watch(void) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd = { inotify_fd, POLLIN, 0 };
+
+    for (;;) {
+        int timeout = -1;
+        int changed = 0;
+        int ready;
+        while ((ready = poll(&pfd, 1, timeout)) != 0) {
+            if (ready == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("poll");
+                return -1;
+            }
+            if (read(inotify_fd, events, sizeof(events)) == -1 && errno != EINTR) {
+                perror("read");
+                return -1;
+            }
+            changed = 1;
+            timeout = WATCH_SETTLE_MS;
+        }
+        if (changed && run() == -1) {
+            return -1;
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int watch_mode = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+i:w")) != -1) {
+        switch (opt) {
+        case 'i':
+            index_path = optarg;
+            break;
+        case 'w':
+            watch_mode = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-i index] <filesdir> <searchstr>\n"
+                    "       %s -w -i index <filesdir>\n", argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != (watch_mode ? 1 : 2) || (watch_mode && index_path == NULL)) {
+        fprintf(stderr, "Please provide input 'filesdir' and 'searchstr'\n");
+        return EXIT_FAILURE;
+    }
+
+    /* The index is tied to the directory, however it is named on the command line */
+    if ((index_path != NULL ? realpath(argv[optind], root_path) == NULL
+                            : snprintf(root_path, sizeof(root_path), "%s", argv[optind]) < 0)) {
+        fprintf(stderr, "Error: 'filsdir' does not represent a directory in filesystem\n");
+        return EXIT_FAILURE;
+    }
+    if (!watch_mode) {
+        needle = argv[optind + 1];
+        needle_len = strlen(needle);
+    }
+
+    if (index_path != NULL) {
+        index_load();
+    }
+    if (watch_mode) {
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd == -1) {
+            perror("inotify_init1");
+            return EXIT_FAILURE;
+        }
+    }
+    if (run() == -1) {
+        return EXIT_FAILURE;
+    }
+    if (watch_mode) {
+        return watch() == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    printf("The number of files are %lu and the number of matching lines are %lu\n",
+           atomic_load(&matching_files), atomic_load(&matching_lines));
+    return EXIT_SUCCESS;
+}
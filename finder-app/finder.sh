@@ -13,6 +13,20 @@ fi
 filesdir=$1
 searchstr=$2
 
+# The native finder does the same count in one pass, but only for fixed strings
+# that grep would also see as a single fixed-string argument.  Set FINDER_INDEX
+# to an index file to reuse it across runs.
+finder="$(dirname "$0")/finder"
+case "${searchstr}" in
+*[].*^\$\\[\ \	]*|"")
+    ;;
+*)
+    if [ -x "${finder}" ]; then
+        exec "${finder}" ${FINDER_INDEX:+-i "${FINDER_INDEX}"} "${filesdir}" "${searchstr}"
+    fi
+    ;;
+esac
+
 matchcount=$(grep -R -c ${searchstr} ${filesdir} | awk -F: '{sum += $2} END {print sum}')
 
 filecount=$(grep -rl  ${searchstr} ${filesdir} | wc -l)
@@ -116,6 +116,7 @@ make CROSS_COMPILE=${CROSS_COMPILE}
 # Copy the finder related scripts and executables to the /home directory
 # on the target rootfs
 sudo cp ${current_directory}/finder-app/writer ${OUTDIR}/rootfs/home/
+sudo cp ${current_directory}/finder-app/finder ${OUTDIR}/rootfs/home/
 sudo cp ${current_directory}/finder-app/finder.sh ${OUTDIR}/rootfs/home/
 sudo cp -r ${current_directory}/finder-app/conf/ ${OUTDIR}/rootfs/home/
 sudo cp ${current_directory}/finder-app/finder-test.sh ${OUTDIR}/rootfs/home/
@@ -1,16 +1,360 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "../examples/threading/threadpool.h"
 
+/* Files claimed by a batch worker at a time */
+#define BATCH_CHUNK 64
+/* Copies of the string handed to one writev() */
+#define WRITE_BATCH_IOV 64
+#define DEFAULT_BATCH_THREADS 4
+#define MAX_BATCH_THREADS 64
+
+struct manifest_entry {
+    const char *name;
+    const char *data;
+    size_t len;
+};
+
+/*
+ * One batch run: either a manifest of name/string pairs or a count of files
+ * named from a template, all created relative to dir_fd.
+ */
+struct batch {
+    int dir_fd;
+    int preallocate;
+    unsigned long repeat;
+    struct manifest_entry *entries;
+    const char *template;
+    const char *data;
+    size_t len;
+    unsigned long count;
+    atomic_ulong next;
+    atomic_ulong written;
+    atomic_ulong failed;
+    atomic_ullong bytes;
+    atomic_flag error_logged;
+};
+
+static void usage(const char *prog) {
+    syslog(LOG_ERR, "Please provide input <file> and <string> for %s utility, "
+           "or [-f] [-j threads] [-r repeat] -m <manifest> <dir>, "
+           "or [-f] [-j threads] [-r repeat] -n <count> -t <template> <dir> <string>", prog);
+}
+
+/**
+ * Write @param repeat copies of @param len bytes at @param data to @param fd,
+ * WRITE_BATCH_IOV copies per writev().
+ * @return 0 on success, -1 with errno set on failure.
+ */
+static int write_repeated(int fd, const char *data, size_t len, unsigned long repeat) {
+    struct iovec iov[WRITE_BATCH_IOV];
+
+    if (len == 0) {
+        return 0;
+    }
+    while (repeat > 0) {
+        int count = repeat < WRITE_BATCH_IOV ? (int)repeat : WRITE_BATCH_IOV;
+        for (int i = 0; i < count; i++) {
+            iov[i].iov_base = (void *)data;
+            iov[i].iov_len = len;
+        }
+        size_t expected = count * len;
+        ssize_t n = writev(fd, iov, count);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        /* Finish a short write one piece at a time */
+        for (size_t done = n; done < expected;) {
+            size_t offset = done % len;
+            ssize_t m = write(fd, data + offset, len - offset);
+            if (m == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return -1;
+            }
+            done += m;
+        }
+        repeat -= count;
+    }
+    return 0;
+}
+
+static void write_one(struct batch *batch, const char *name, const char *data, size_t len) {
+    unsigned long long total = (unsigned long long)len * batch->repeat;
+    const char *what = "opening";
+
+    int fd = openat(batch->dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) {
+        what = "allocating";
+        if (!batch->preallocate || total == 0 || fallocate(fd, 0, 0, total) == 0 ||
+            errno == EOPNOTSUPP || errno == ENOSYS) {
+            what = "writing to";
+            if (write_repeated(fd, data, len, batch->repeat) == 0) {
+                what = NULL;
+            }
+        }
+        if (close(fd) == -1 && what == NULL) {
+            what = "closing";
+        }
+    }
+
+    if (what != NULL) {
+        /* Only the first failure is logged; the summary line has the count */
+        if (!atomic_flag_test_and_set(&batch->error_logged)) {
+            syslog(LOG_ERR, "Error while %s file %s: %s", what, name, strerror(errno));
+        }
+        atomic_fetch_add_explicit(&batch->failed, 1, memory_order_relaxed);
+        return;
+    }
+    atomic_fetch_add_explicit(&batch->written, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&batch->bytes, total, memory_order_relaxed);
+}
+
+/**
+ * Pool task: claim BATCH_CHUNK files at a time until the batch is done.
+ */
+static void *batch_worker(void *arg) {
+    struct batch *batch = (struct batch *)arg;
+    char name[PATH_MAX];
+
+    for (;;) {
+        unsigned long start = atomic_fetch_add(&batch->next, BATCH_CHUNK);
+        if (start >= batch->count) {
+            break;
+        }
+        unsigned long end = start + BATCH_CHUNK < batch->count ? start + BATCH_CHUNK : batch->count;
+        for (unsigned long i = start; i < end; i++) {
+            if (batch->entries != NULL) {
+                struct manifest_entry *entry = &batch->entries[i];
+                write_one(batch, entry->name, entry->data, entry->len);
+            } else {
+                /* Numbered from 1, as the finder-test.sh loop did; main() keeps it in %u */
+                snprintf(name, sizeof(name), batch->template, (unsigned int)(i + 1));
+                write_one(batch, name, batch->data, batch->len);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return true if @param template has exactly one %u conversion (and any number of %%).
+ */
+static int valid_template(const char *template) {
+    int conversions = 0;
+
+    for (const char *p = strchr(template, '%'); p != NULL; p = strchr(p, '%')) {
+        if (p[1] == '%') {
+            p += 2;
+        } else if (p[1] == 'u') {
+            conversions++;
+            p += 2;
+        } else {
+            return 0;
+        }
+    }
+    return conversions == 1;
+}
+
+/**
+ * Read @param path into memory and split it into "name<TAB>string" lines,
+ * skipping empty ones.  Names and strings point into the returned buffer,
+ * which must stay allocated while @param entries_out is in use.
+ * @return the buffer, or NULL on error (already logged).
+ */
+static char *read_manifest(const char *path, struct manifest_entry **entries_out,
+                           unsigned long *count_out) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        syslog(LOG_ERR, "Error while opening manifest %s: %s", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    char *buf = malloc(st.st_size + 1);
+    ssize_t len = 0, n;
+    while (buf != NULL && len < st.st_size &&
+           ((n = read(fd, buf + len, st.st_size - len)) > 0 || (n == -1 && errno == EINTR))) {
+        len += n > 0 ? n : 0;
+    }
+    close(fd);
+    if (buf == NULL || len < st.st_size) {
+        syslog(LOG_ERR, "Error while reading manifest %s: %s", path, strerror(errno));
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    struct manifest_entry *entries = NULL;
+    unsigned long count = 0, capacity = 0, line_number = 0;
+    for (char *line = buf; line < buf + len;) {
+        char *newline = memchr(line, '\n', buf + len - line);
+        char *line_end = newline ? newline : buf + len;
+        char *next = newline ? newline + 1 : buf + len;
+        line_number++;
+        if (line_end == line) {
+            line = next;
+            continue;
+        }
+
+        char *tab = memchr(line, '\t', line_end - line);
+        if (tab == NULL || tab == line) {
+            syslog(LOG_ERR, "Manifest %s line %lu is not <file><TAB><string>", path, line_number);
+            free(entries);
+            free(buf);
+            return NULL;
+        }
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            struct manifest_entry *grown = realloc(entries, capacity * sizeof(*entries));
+            if (grown == NULL) {
+                syslog(LOG_ERR, "Out of memory reading manifest %s", path);
+                free(entries);
+                free(buf);
+                return NULL;
+            }
+            entries = grown;
+        }
+        *tab = '\0';
+        *line_end = '\0';
+        entries[count].name = line;
+        entries[count].data = tab + 1;
+        entries[count].len = line_end - (tab + 1);
+        count++;
+        line = next;
+    }
+
+    *entries_out = entries;
+    *count_out = count;
+    return buf;
+}
+
+/**
+ * Batch mode: create every file of @param batch under @param dir on a pool
+ * of @param threads workers and log one summary line.
+ * @return EXIT_SUCCESS if every file was written.
+ */
+static int run_batch(struct batch *batch, const char *dir, unsigned int threads) {
+    struct timespec start, end;
+
+    batch->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (batch->dir_fd == -1) {
+        syslog(LOG_ERR, "Error while opening directory %s: %s", dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (threads > batch->count / BATCH_CHUNK + 1) {
+        threads = batch->count / BATCH_CHUNK + 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct threadpool *pool = threadpool_create(threads, threads);
+    if (pool == NULL) {
+        syslog(LOG_ERR, "Error while starting %u writer threads", threads);
+        close(batch->dir_fd);
+        return EXIT_FAILURE;
+    }
+    for (unsigned int i = 0; i < threads; i++) {
+        threadpool_post(pool, batch_worker, batch);
+    }
+    threadpool_destroy(pool);
+    /* In case a post failed, finish whatever the workers left */
+    batch_worker(batch);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    close(batch->dir_fd);
+
+    unsigned long failed = atomic_load(&batch->failed);
+    syslog(failed ? LOG_ERR : LOG_DEBUG, "Wrote %lu files (%llu bytes) to %s with %u threads "
+           "in %.3f s, %lu failed", atomic_load(&batch->written), atomic_load(&batch->bytes),
+           dir, threads, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+           failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
 int main(int argc, char *argv[]) {
- 
+
     openlog("writer", LOG_PID, LOG_USER);
- 
+
+    struct batch batch = { .repeat = 1 };
+    const char *manifest = NULL;
+    unsigned int threads = DEFAULT_BATCH_THREADS;
+    int opt;
+    /* Two arguments are always <file> <string>, even if the string starts with '-' */
+    while (argc != 3 && (opt = getopt(argc, argv, "+fj:m:n:r:t:")) != -1) {
+        switch (opt) {
+        case 'f':
+            batch.preallocate = 1;
+            break;
+        case 'j':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        case 'n':
+            batch.count = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            batch.repeat = strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            batch.template = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (threads == 0 || threads > MAX_BATCH_THREADS) {
+        threads = DEFAULT_BATCH_THREADS;
+    }
+
+    if (manifest != NULL) {
+        if (argc - optind != 1 || batch.template != NULL) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        char *buf = read_manifest(manifest, &batch.entries, &batch.count);
+        if (buf == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        int status = run_batch(&batch, argv[optind], threads);
+        free(batch.entries);
+        free(buf);
+        closelog();
+        return status;
+    }
+
+    if (batch.template != NULL) {
+        if (argc - optind != 2 || !valid_template(batch.template) || batch.count > UINT_MAX) {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        batch.data = argv[optind + 1];
+        batch.len = strlen(batch.data);
+        int status = run_batch(&batch, argv[optind], threads);
+        closelog();
+        return status;
+    }
+
     if (argc != 3) {
-        syslog(LOG_ERR, "Please provide input <file> and <string> for %s utility", argv[0]);
+        usage(argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -18,7 +362,7 @@ int main(int argc, char *argv[]) {
     const char *writestr = argv[2];
 
     /*Start Create file*/
-    
+
     FILE *file = fopen(writefile, "w");
     if (file == NULL) {
         syslog(LOG_ERR, "Error while opening file %s: %s", writefile, strerror(errno));
@@ -34,11 +378,9 @@ int main(int argc, char *argv[]) {
 
     fclose(file);
     syslog(LOG_DEBUG, "Writing %s to %s", writestr, writefile);
-    
+
     /* End create file */
 
     closelog();
     return EXIT_SUCCESS;
 }
-
-
@@ -0,0 +1,243 @@
+/**
+ * @file aesd-shm-ring.c
+ * @brief Shared-memory multi-producer single-consumer record ring
+ *
+ * See aesd-shm-ring.h for the layout and the publishing protocol.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd-shm-ring.h"
+
+/* Record flag: skip to the start of the ring, the record didn't fit before the end */
+#define SHM_RING_PAD 1u
+
+/* Header of every record; seq is stored last, with release ordering */
+struct shm_ring_record {
+    atomic_uint_least64_t seq;
+    uint32_t len;
+    uint32_t flags;
+};
+
+_Static_assert(sizeof(struct shm_ring_record) == SHM_RING_RECORD_HEADER,
+               "record header size");
+_Static_assert(sizeof(struct shm_ring_control) % 64 == 0, "record area alignment");
+
+static inline uint64_t record_size(size_t len) {
+    return (SHM_RING_RECORD_HEADER + len + SHM_RING_RECORD_HEADER - 1) &
+           ~(uint64_t)(SHM_RING_RECORD_HEADER - 1);
+}
+
+static inline struct shm_ring_record *record_at(const struct shm_ring *ring, uint64_t pos) {
+    return (struct shm_ring_record *)(ring->data + (pos & ring->mask));
+}
+
+/**
+ * Map @param size bytes of @param ring->fd and fill in the process-local view.
+ * @return 0 on success, -1 on error.
+ */
+static int map_ring(struct shm_ring *ring, size_t size) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    ring->control = map;
+    ring->data = (char *)map + sizeof(struct shm_ring_control);
+    ring->map_size = size;
+    return 0;
+}
+
+int shm_ring_create(struct shm_ring *ring, const char *name, size_t capacity) {
+    uint64_t size = SHM_RING_MIN_CAPACITY;
+    while (size < capacity) {
+        size *= 2;
+    }
+
+    /* Producers in other processes rely on these being lock-free */
+    atomic_uint_least64_t probe;
+    if (!atomic_is_lock_free(&probe)) {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = name != NULL ? shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0660)
+                            : memfd_create("aesd-shm-ring", MFD_CLOEXEC);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    size_t map_size = sizeof(struct shm_ring_control) + size;
+    if (ftruncate(ring->fd, map_size) == -1 || map_ring(ring, map_size) == -1) {
+        int saved_errno = errno;
+        close(ring->fd);
+        if (name != NULL) {
+            shm_unlink(name);
+        }
+        errno = saved_errno;
+        return -1;
+    }
+
+    ring->mask = size - 1;
+    ring->control->capacity = size;
+    ring->control->version = SHM_RING_VERSION;
+    atomic_store(&ring->control->head, 0);
+    atomic_store(&ring->control->tail, 0);
+    /* A zeroed header would read as a record published at position 0 */
+    atomic_store_explicit(&record_at(ring, 0)->seq, UINT64_MAX, memory_order_relaxed);
+    atomic_store_explicit(&ring->control->magic, SHM_RING_MAGIC, memory_order_release);
+    return 0;
+}
+
+int shm_ring_open(struct shm_ring *ring, const char *name) {
+    struct stat st;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    if (ring->fd == -1) {
+        return -1;
+    }
+    /* Left in errno if the object is too small to be a ring */
+    errno = EPROTO;
+    if (fstat(ring->fd, &st) == -1 || (size_t)st.st_size < sizeof(struct shm_ring_control) ||
+        map_ring(ring, st.st_size) == -1) {
+        int saved_errno = errno;
+        close(ring->fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    uint64_t capacity = ring->control->capacity;
+    if (atomic_load_explicit(&ring->control->magic, memory_order_acquire) != SHM_RING_MAGIC ||
+        ring->control->version != SHM_RING_VERSION || capacity < SHM_RING_MIN_CAPACITY ||
+        (capacity & (capacity - 1)) != 0 ||
+        sizeof(struct shm_ring_control) + capacity > (size_t)st.st_size) {
+        shm_ring_close(ring);
+        errno = EPROTO;
+        return -1;
+    }
+    ring->mask = capacity - 1;
+    atomic_store(&ring->cached_tail, atomic_load(&ring->control->tail));
+    return 0;
+}
+
+void shm_ring_close(struct shm_ring *ring) {
+    if (ring->control != NULL) {
+        munmap(ring->control, ring->map_size);
+        ring->control = NULL;
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+static void publish(struct shm_ring_record *record, uint64_t pos, uint32_t len, uint32_t flags) {
+    record->len = len;
+    record->flags = flags;
+    atomic_store_explicit(&record->seq, pos, memory_order_release);
+}
+
+int shm_ring_push(struct shm_ring *ring, const void *data, size_t len) {
+    struct shm_ring_control *control = ring->control;
+    uint64_t capacity = ring->mask + 1;
+    uint64_t size = record_size(len);
+    uint64_t head, pad;
+
+    /* Half the ring, so a record always fits after at most one pad record */
+    if (len > UINT32_MAX || size > capacity / 2) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    head = atomic_load_explicit(&control->head, memory_order_relaxed);
+    do {
+        uint64_t offset = head & ring->mask;
+        pad = capacity - offset < size ? capacity - offset : 0;
+        uint64_t tail = atomic_load_explicit(&ring->cached_tail, memory_order_relaxed);
+        if (head + pad + size - tail > capacity) {
+            /* Acquire: the consumer is done reading whatever we are about to overwrite */
+            tail = atomic_load_explicit(&control->tail, memory_order_acquire);
+            atomic_store_explicit(&ring->cached_tail, tail, memory_order_relaxed);
+            if (head + pad + size - tail > capacity) {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&control->head, &head, head + pad + size,
+                                                    memory_order_relaxed, memory_order_relaxed));
+
+    if (pad != 0) {
+        publish(record_at(ring, head), head, 0, SHM_RING_PAD);
+        head += pad;
+    }
+    struct shm_ring_record *record = record_at(ring, head);
+    memcpy(record + 1, data, len);
+    publish(record, head, len, 0);
+
+    /* Pairs with the fence in shm_ring_wait(): either we see it asleep, or it sees the record */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&control->consumer_sleeping, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&control->wake_seq, 1, memory_order_relaxed);
+        syscall(SYS_futex, &control->wake_seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+int shm_ring_peek(struct shm_ring *ring, struct iovec *iov, int max, uint64_t *consumed) {
+    uint64_t tail = atomic_load_explicit(&ring->control->tail, memory_order_relaxed);
+    uint64_t capacity = ring->mask + 1;
+    uint64_t pos = tail;
+    int count = 0;
+
+    while (count < max) {
+        struct shm_ring_record *record = record_at(ring, pos);
+        if (atomic_load_explicit(&record->seq, memory_order_acquire) != pos) {
+            break;
+        }
+        uint64_t offset = pos & ring->mask;
+        if (record->flags & SHM_RING_PAD) {
+            pos += capacity - offset;
+            continue;
+        }
+        /* Producers may be buggy or hostile: never trust a length to stay in the mapping */
+        uint64_t size = record_size(record->len);
+        if (size > capacity - offset) {
+            errno = EBADMSG;
+            return -1;
+        }
+        iov[count].iov_base = record + 1;
+        iov[count].iov_len = record->len;
+        count++;
+        pos += size;
+    }
+    *consumed = pos - tail;
+    return count;
+}
+
+void shm_ring_consume(struct shm_ring *ring, uint64_t consumed) {
+    uint64_t tail = atomic_load_explicit(&ring->control->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->control->tail, tail + consumed, memory_order_release);
+}
+
+void shm_ring_wait(struct shm_ring *ring, int timeout_ms) {
+    struct shm_ring_control *control = ring->control;
+    uint64_t tail = atomic_load_explicit(&control->tail, memory_order_relaxed);
+    struct timespec timeout = { timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L };
+
+    atomic_store_explicit(&control->consumer_sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned int seq = atomic_load_explicit(&control->wake_seq, memory_order_relaxed);
+    if (atomic_load_explicit(&record_at(ring, tail)->seq, memory_order_acquire) != tail) {
+        syscall(SYS_futex, &control->wake_seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+    }
+    atomic_store_explicit(&control->consumer_sleeping, 0, memory_order_relaxed);
+}
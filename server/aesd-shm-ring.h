@@ -0,0 +1,110 @@
+/*
+ * aesd-shm-ring.h
+ *
+ * Shared-memory record channel from any number of producer processes to a
+ * single consumer.  Like struct aesd_circular_buffer it is a ring of
+ * variable length writes, but the records are stored inline in one mapping
+ * (shm_open() or memfd_create()) instead of as pointers to separately
+ * allocated buffers, so every process mapping the ring sees the same data.
+ *
+ * A record is a SHM_RING_RECORD_HEADER header followed by the payload,
+ * padded to the header size.  Producers claim space by advancing head with
+ * a compare-and-swap, copy the payload in and publish the record by storing
+ * its ring position into the header with release ordering; the consumer
+ * reads records in order while the stored position matches, and frees them
+ * by advancing tail.  Neither side makes a system call per record: the only
+ * one is a futex wake, and only while the consumer is asleep in
+ * shm_ring_wait().
+ */
+
+#ifndef AESD_SHM_RING_H
+#define AESD_SHM_RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define SHM_RING_MAGIC 0x52534541u /* "AESR" */
+#define SHM_RING_VERSION 1
+#define SHM_RING_RECORD_HEADER 16
+#define SHM_RING_MIN_CAPACITY 4096
+
+/* Start of the shared mapping; the record area follows it */
+struct shm_ring_control {
+    /* Stored last by shm_ring_create(), once the rest is initialised */
+    atomic_uint magic;
+    uint32_t version;
+    uint64_t capacity;
+    /* Next ring position producers will claim */
+    _Alignas(64) atomic_uint_least64_t head;
+    /* Next ring position the consumer will read; everything before it is free */
+    _Alignas(64) atomic_uint_least64_t tail;
+    /* Futex bumped by producers to wake a consumer sleeping in shm_ring_wait() */
+    _Alignas(64) atomic_uint wake_seq;
+    atomic_uint consumer_sleeping;
+};
+
+/* One process's view of a ring */
+struct shm_ring {
+    struct shm_ring_control *control;
+    char *data;
+    uint64_t mask;
+    size_t map_size;
+    int fd;
+    /* Producer-side copy of tail, refreshed only when the ring looks full */
+    atomic_uint_least64_t cached_tail;
+};
+
+/**
+ * Create a ring with room for @param capacity bytes of records (rounded up to
+ * a power of two) and map it into @param ring.  @param name is a POSIX shared
+ * memory name such as "/aesdsocket", or NULL for an anonymous memfd that can
+ * be shared by forking or by passing ring->fd.
+ * @return 0 on success, -1 with errno set on failure.
+ */
+int shm_ring_create(struct shm_ring *ring, const char *name, size_t capacity);
+
+/**
+ * Map the existing ring called @param name into @param ring.
+ * @return 0 on success, -1 with errno set on failure (EPROTO if it isn't a ring).
+ */
+int shm_ring_open(struct shm_ring *ring, const char *name);
+
+/**
+ * Unmap @param ring and close its descriptor.  The shared memory object
+ * itself stays until shm_unlink().
+ */
+void shm_ring_close(struct shm_ring *ring);
+
+/**
+ * Copy @param len bytes at @param data into @param ring as one record.
+ * Safe to call from any number of threads and processes at once.
+ * @return 0 on success, -1 with errno EAGAIN if the ring is full or
+ * EMSGSIZE if the record can never fit.
+ */
+int shm_ring_push(struct shm_ring *ring, const void *data, size_t len);
+
+/**
+ * Consumer side: point up to @param max entries of @param iov at the
+ * payloads of the oldest published records, in order, without copying them.
+ * @param consumed is set to the ring bytes they occupy, to hand to
+ * shm_ring_consume() once the payloads are no longer needed.
+ * @return the number of records, 0 if none are ready, or -1 with errno
+ * EBADMSG if the ring holds a malformed record.
+ */
+int shm_ring_peek(struct shm_ring *ring, struct iovec *iov, int max, uint64_t *consumed);
+
+/**
+ * Consumer side: release @param consumed bytes returned by shm_ring_peek()
+ * to the producers.
+ */
+void shm_ring_consume(struct shm_ring *ring, uint64_t consumed);
+
+/**
+ * Consumer side: sleep until a producer publishes a record or
+ * @param timeout_ms passes.  Returns at once if a record is already waiting.
+ */
+void shm_ring_wait(struct shm_ring *ring, int timeout_ms);
+
+#endif /* AESD_SHM_RING_H */
@@ -0,0 +1,233 @@
+#!/bin/sh
+# Per-record latency breakdown of aesdsocket and the aesdchar driver.
+#
+#   aesd-trace.sh record [seconds] [output]
+#       Trace the aesdsocket USDT probes and the aesdchar tracepoints on this
+#       box with perf for the given time (default 10 s) into output
+#       (default aesd-trace.data).  Needs root and an aesdsocket built with
+#       <sys/sdt.h>; AESDSOCKET names the binary (default: the one in PATH).
+#   aesd-trace.sh report [input]
+#       Print how long records spend in each stage.  input is a perf.data
+#       file, or text from "perf script" or from the ftrace trace file, in
+#       which case the uprobes and aesdchar events are expected to have been
+#       set up by hand.  "-" reads text from stdin.
+#
+# Stages, per record (see aesdsocket-trace.h):
+#   parse       last recv on the thread -> record_start
+#   lock        record_start -> record_locked, waiting for data_mutex
+#   write       record_locked -> record_written, of which the driver spent
+#     drv_lock    aesdchar_write_enter -> aesdchar_write_locked
+#     krealloc    aesdchar_write_locked -> aesdchar_write_alloc
+#     copy        aesdchar_write_alloc -> aesdchar_write_exit
+#   read_back   record_written -> record_read_back, of which the driver spent
+#     drv_read    every aesdchar_read_enter -> aesdchar_read_exit in between
+#   send        record_read_back -> the next send on the thread
+#   total       last recv -> the next send
+# Probe events are keyed on their record id.  Driver events can't carry it,
+# so they go to the record in flight on their thread.
+
+set -e
+
+usage() {
+    echo "Usage: $0 {record [seconds] [output]|report [input]}"
+    exit 1
+}
+
+record() {
+    seconds=${1:-10}
+    output=${2:-aesd-trace.data}
+    binary=${AESDSOCKET:-$(command -v aesdsocket)}
+    if [ -z "${binary}" ]; then
+        echo "aesdsocket not found, set AESDSOCKET"
+        exit 1
+    fi
+
+    perf buildid-cache --add "${binary}"
+    perf probe --quiet -x "${binary}" --add 'sdt_aesdsocket:*' 2>/dev/null || true
+    perf record -q -a -o "${output}" -e 'sdt_aesdsocket:*' -e 'aesdchar:*' -- sleep "${seconds}"
+    echo "Wrote ${output}; run: $0 report ${output}"
+}
+
+# Turn perf script or ftrace text into "tid time event args..." lines
+normalize() {
+    awk '{
+        for (i = 2; i <= NF; i++) {
+            if ($i ~ /^[0-9]+\.[0-9]+:$/) {
+                break
+            }
+        }
+        if (i >= NF) {
+            next
+        }
+        ts = substr($i, 1, length($i) - 1)
+        event = $(i + 1)
+        sub(/:$/, "", event)
+        sub(/^.*:/, "", event)
+        # perf: "comm tid [cpu]"; ftrace: "comm-tid [cpu] flags"
+        for (c = 1; c < i; c++) {
+            if ($c ~ /^\[[0-9]+\]$/) {
+                break
+            }
+        }
+        tid = $(c - 1)
+        if (tid !~ /^[0-9]+$/) {
+            sub(/^.*-/, "", tid)
+        }
+        line = tid " " ts " " event
+        for (a = i + 2; a <= NF; a++) {
+            line = line " " $a
+        }
+        print line
+    }'
+}
+
+# Emit "rank stage microseconds" for every completed record, rank giving the stage order
+stages() {
+    awk '
+    BEGIN {
+        split("parse lock write drv_lock krealloc copy read_back drv_read send total", names)
+        for (r in names) {
+            rank[names[r]] = r
+        }
+    }
+    function emit(stage, seconds) {
+        printf "%d %s %.3f\n", rank[stage], stage, seconds * 1000000
+    }
+    # The record id, the first probe argument, as "arg1=5" or the like
+    function record_id(   a, v) {
+        for (a = 4; a <= NF; a++) {
+            if ($a ~ /=/) {
+                v = $a
+                sub(/^[^=]*=/, "", v)
+                return v
+            }
+        }
+        return ""
+    }
+    # Report the record in flight on tid, which then waits for the next send
+    function finish(tid,   id) {
+        if (!(tid in current)) {
+            return
+        }
+        id = current[tid]
+        delete current[tid]
+        if (!(id in written)) {
+            delete start[id]; delete from[id]
+            return
+        }
+        if (from[id] != start[id]) {
+            emit("parse", start[id] - from[id])
+        }
+        emit("lock", locked[id] - start[id])
+        emit("write", written[id] - locked[id])
+        if (id in w_locked) {
+            emit("drv_lock", w_locked[id] - w_enter[id])
+            emit("krealloc", w_alloc[id] - w_locked[id])
+            emit("copy", w_exit[id] - w_alloc[id])
+        }
+        if (id in read_back) {
+            emit("read_back", read_back[id] - written[id])
+            emit("drv_read", drv_read[id])
+        }
+        done[id] = (id in read_back) ? read_back[id] : written[id]
+        unsent[tid] = unsent[tid] " " id
+        delete start[id]; delete locked[id]; delete written[id]; delete read_back[id]
+        delete w_enter[id]; delete w_locked[id]; delete w_alloc[id]; delete w_exit[id]
+        delete drv_read[id]
+    }
+    {
+        tid = $1; ts = $2; ev = $3
+        if (ev == "recv") {
+            recv_at[tid] = ts
+        } else if (ev == "record_start") {
+            finish(tid)
+            id = record_id()
+            current[tid] = id
+            start[id] = ts
+            from[id] = (tid in recv_at) ? recv_at[tid] : ts
+        } else if (ev == "record_locked") {
+            locked[record_id()] = ts
+        } else if (ev == "record_written") {
+            written[record_id()] = ts
+        } else if (ev == "record_read_back") {
+            read_back[record_id()] = ts
+            finish(tid)
+        } else if (ev == "send") {
+            finish(tid)
+            n = split(unsent[tid], ids, " ")
+            for (k = 1; k <= n; k++) {
+                emit("send", ts - done[ids[k]])
+                emit("total", ts - from[ids[k]])
+                delete done[ids[k]]; delete from[ids[k]]
+            }
+            delete unsent[tid]
+        } else if (!(tid in current)) {
+            next
+        } else if (ev == "aesdchar_write_enter") {
+            w_enter[current[tid]] = ts
+        } else if (ev == "aesdchar_write_locked") {
+            w_locked[current[tid]] = ts
+        } else if (ev == "aesdchar_write_alloc") {
+            w_alloc[current[tid]] = ts
+        } else if (ev == "aesdchar_write_exit") {
+            w_exit[current[tid]] = ts
+        } else if (ev == "aesdchar_read_enter") {
+            r_enter[tid] = ts
+        } else if (ev == "aesdchar_read_exit" && (tid in r_enter)) {
+            drv_read[current[tid]] += ts - r_enter[tid]
+            delete r_enter[tid]
+        }
+    }'
+}
+
+# Summarize the stage lines per stage
+summarize() {
+    sort -k1,1n -k3,3n | awk '
+    function flush() {
+        if (n == 0) {
+            return
+        }
+        printf "%-10s %8d %10.1f %10.1f %10.1f %10.1f\n", stage, n, sum / n,
+               v[int((n - 1) * 0.5) + 1], v[int((n - 1) * 0.99) + 1], v[n]
+    }
+    BEGIN {
+        printf "%-10s %8s %10s %10s %10s %10s\n", "stage", "records", "mean_us", "p50_us",
+               "p99_us", "max_us"
+    }
+    $2 != stage {
+        flush()
+        stage = $2; n = 0; sum = 0
+    }
+    {
+        v[++n] = $3; sum += $3
+    }
+    END {
+        flush()
+    }'
+}
+
+report() {
+    input=${1:-aesd-trace.data}
+    if [ "${input}" = "-" ]; then
+        cat
+    elif [ "$(head -c 8 "${input}")" = "PERFILE2" ]; then
+        perf script -i "${input}" -F comm,tid,cpu,time,event,trace
+    else
+        cat "${input}"
+    fi | normalize | sort -s -k2,2n | stages | summarize
+}
+
+case "$1" in
+    record)
+        shift
+        record "$@"
+        ;;
+    report)
+        shift
+        report "$@"
+        ;;
+    *)
+        usage
+        ;;
+esac
+exit 0
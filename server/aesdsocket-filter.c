@@ -0,0 +1,130 @@
+/**
+ * @file aesdsocket-filter.c
+ * @brief Filtered read-back: only the entries matching a pattern
+ *
+ * The aesdchar driver filters its entries itself through AESDCHAR_IOCFILTER.
+ * Any other data_path (a regular file, a follower's replica, or a driver
+ * without the ioctl) is read back whole into the output buffer and the
+ * matching lines are compacted in place, so no second buffer is needed.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+#include "../finder-app/find.h"
+
+/**
+ * Keep only the lines of the @param size bytes at @param data matching
+ * @param pattern, moving them to the front in order.  An unterminated last
+ * line counts as a line.
+ * @return the length of the matching lines.
+ */
+static size_t filter_lines(char *data, size_t size, uint32_t mode, const char *pattern,
+                           size_t len) {
+    char *end = data + size;
+    char *line = data;
+    size_t kept = 0;
+
+    while (line < end) {
+        char *match;
+        if (mode == AESD_FILTER_PREFIX || len == 0) {
+            match = (size_t)(end - line) >= len && memcmp(line, pattern, len) == 0 ? line : NULL;
+        } else {
+            match = (char *)find(line, end, pattern, len);
+            if (match == NULL) {
+                break;
+            }
+            /* Back up to the start of the line holding the match */
+            char *newline = memrchr(line, '\n', match - line);
+            line = newline != NULL ? newline + 1 : line;
+        }
+        char *from = match != NULL ? match : line;
+        char *newline = memchr(from, '\n', end - from);
+        char *next = newline != NULL ? newline + 1 : end;
+        if (match != NULL) {
+            memmove(data + kept, line, next - line);
+            kept += next - line;
+        }
+        line = next;
+    }
+    return kept;
+}
+
+/**
+ * Ask the driver behind @param fd for the matching entries, straight into
+ * the output buffer of @param conn, growing it until they all fit.
+ * @return 0 on success, -1 with errno set (ENOTTY if @param fd isn't an
+ * aesdchar device that can filter).
+ */
+static int filter_device(struct connection *conn, int fd, uint32_t mode, const char *pattern,
+                         size_t len) {
+    struct aesd_filter filter;
+    size_t want = 4096;
+
+    for (;;) {
+        if (buffer_reserve(&conn->out, want) == -1) {
+            errno = ENOMEM;
+            return -1;
+        }
+        size_t room = conn->out.cap - conn->out.len;
+        memset(&filter, 0, sizeof(filter));
+        filter.mode = mode;
+        filter.pattern_len = len;
+        filter.pattern = (uint64_t)(uintptr_t)pattern;
+        filter.buf = (uint64_t)(uintptr_t)(conn->out.data + conn->out.len);
+        filter.buf_len = room > UINT32_MAX ? UINT32_MAX : room;
+        if (ioctl(fd, AESDCHAR_IOCFILTER, &filter) == -1) {
+            return -1;
+        }
+        if (filter.copied == filter.needed) {
+            conn->out.len += filter.copied;
+            return 0;
+        }
+        /* Entries may have grown since; ask for their size now */
+        want = filter.needed;
+    }
+}
+
+int read_filtered_content(struct connection *conn, uint32_t mode, const char *pattern,
+                          size_t len) {
+    if (mode > AESD_FILTER_PREFIX || len > AESD_FILTER_MAX_PATTERN) {
+        return 0;
+    }
+    int fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if (filter_device(conn, fd, mode, pattern, len) == 0) {
+        close(fd);
+        return 0;
+    }
+    if (errno != ENOTTY && errno != EINVAL) {
+        perror("ioctl AESDCHAR_IOCFILTER");
+        close(fd);
+        return -1;
+    }
+
+    size_t base = conn->out.len;
+    ssize_t bytes_read;
+    do {
+        if (buffer_reserve(&conn->out, 1024) == -1) {
+            close(fd);
+            return -1;
+        }
+        bytes_read = read(fd, conn->out.data + conn->out.len, conn->out.cap - conn->out.len);
+        if (bytes_read > 0) {
+            conn->out.len += bytes_read;
+        }
+    } while (bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
+    close(fd);
+
+    conn->out.len = base + filter_lines(conn->out.data + base, conn->out.len - base, mode, pattern,
+                                        len);
+    return bytes_read == 0 ? 0 : -1;
+}
@@ -0,0 +1,343 @@
+/**
+ * @file aesdsocket-frame.c
+ * @brief Binary framed protocol for aesdsocket
+ *
+ * Frames are length prefixed (see FRAME_MAGIC in aesdsocket.h), so requests
+ * are split without scanning for newlines and append payloads may contain
+ * any byte.  Responses are queued on the connection output buffer in
+ * request order and sent by whichever engine serves the connection.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-trace.h"
+
+static uint32_t get_be32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return be32toh(v);
+}
+
+static uint64_t get_be64(const char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return be64toh(v);
+}
+
+static void put_be64(char *p, uint64_t v) {
+    v = htobe64(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+/**
+ * Queue a response header for @param opcode on @param conn with room for
+ * @param payload_len payload bytes after it.
+ * @return pointer to the payload area, or NULL if out of memory.
+ */
+static char *begin_response(struct connection *conn, uint8_t opcode, uint8_t status,
+                            uint32_t payload_len) {
+    if (buffer_reserve(&conn->out, FRAME_HEADER_SIZE + (size_t)payload_len) == -1) {
+        return NULL;
+    }
+    char *header = conn->out.data + conn->out.len;
+    uint32_t len = htobe32(payload_len);
+    header[0] = (char)opcode;
+    header[1] = (char)status;
+    header[2] = 0;
+    header[3] = 0;
+    memcpy(header + 4, &len, sizeof(len));
+    conn->out.len += FRAME_HEADER_SIZE;
+    return conn->out.data + conn->out.len;
+}
+
+static int frame_append(const struct connection *conn, const char *payload, uint32_t len) {
+    uint64_t id = trace_next_record_id();
+
+    /* Writes go to the primary, which streams them back to its followers */
+    if (primary_addr != NULL) {
+        return FRAME_UNSUPPORTED;
+    }
+
+    AESD_PROBE3(record_start, id, conn->client_socket, len);
+    uint64_t wait_start = metrics_now_ns();
+    pthread_mutex_lock(&data_mutex);
+    metrics_observe(METRIC_LOCK_WAIT, metrics_now_ns() - wait_start);
+    AESD_PROBE1(record_locked, id);
+    ssize_t written = write(data_fd, payload, len);
+    AESD_PROBE2(record_written, id, written);
+    if (written == (ssize_t)len) {
+        struct iovec iov = { .iov_base = (void *)payload, .iov_len = len };
+        replicate(&iov, 1);
+    } else {
+        replicate_failed();
+    }
+    pthread_mutex_unlock(&data_mutex);
+
+    if (written != (ssize_t)len) {
+        perror("write");
+        return FRAME_IO_ERROR;
+    }
+    metrics_add(METRIC_RECORDS, 1);
+    return FRAME_OK;
+}
+
+/**
+ * Answer a FRAME_READ_RANGE request by reading up to @param length bytes of
+ * data_path from @param offset straight into the output buffer.
+ */
+static int frame_read_range(struct connection *conn, uint64_t offset, uint32_t length) {
+    if (length > FRAME_MAX_PAYLOAD) {
+        length = FRAME_MAX_PAYLOAD;
+    }
+    char *payload = begin_response(conn, FRAME_READ_RANGE, FRAME_OK, length);
+    if (payload == NULL) {
+        return -1;
+    }
+    char *header = payload - FRAME_HEADER_SIZE;
+
+    uint64_t read_start = metrics_now_ns();
+    size_t total = 0;
+    int status = FRAME_OK;
+    pthread_mutex_lock(&data_mutex);
+    int fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || lseek(fd, (off_t)offset, SEEK_SET) == (off_t)-1) {
+        status = FRAME_IO_ERROR;
+    } else {
+        while (total < length) {
+            ssize_t n = read(fd, payload + total, length - total);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n == -1) {
+                status = FRAME_IO_ERROR;
+            }
+            if (n <= 0) {
+                break;
+            }
+            total += n;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    pthread_mutex_unlock(&data_mutex);
+    metrics_observe(METRIC_READ_BACK, metrics_now_ns() - read_start);
+
+    if (status != FRAME_OK) {
+        total = 0;
+    }
+    uint32_t len = htobe32((uint32_t)total);
+    header[1] = (char)status;
+    memcpy(header + 4, &len, sizeof(len));
+    conn->out.len += total;
+    return 0;
+}
+
+static int frame_stats(struct connection *conn, size_t pending) {
+    uint64_t data_size = 0;
+
+    pthread_mutex_lock(&data_mutex);
+    int fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        off_t end = lseek(fd, 0, SEEK_END);
+        data_size = end == (off_t)-1 ? 0 : (uint64_t)end;
+        close(fd);
+    }
+    pthread_mutex_unlock(&data_mutex);
+
+    char *payload = begin_response(conn, FRAME_STATS, fd == -1 ? FRAME_IO_ERROR : FRAME_OK, 24);
+    if (payload == NULL) {
+        return -1;
+    }
+    put_be64(payload, data_size);
+    put_be64(payload + 8, conn->frames);
+    put_be64(payload + 16, pending);
+    conn->out.len += 24;
+    return 0;
+}
+
+/**
+ * Answer a FRAME_GET_FD request with the current data size and queue a
+ * read-only descriptor of data_path, positioned at the start, to go out with
+ * the response header.  One descriptor at a time may wait to be sent on a
+ * connection; a second request meanwhile fails with FRAME_IO_ERROR.
+ */
+static int frame_get_fd(struct connection *conn) {
+    if (!conn->local || conn->pass_fd != -1) {
+        return begin_response(conn, FRAME_GET_FD,
+                              conn->local ? FRAME_IO_ERROR : FRAME_UNSUPPORTED, 0)
+                       ? 0
+                       : -1;
+    }
+
+    uint64_t data_size = 0;
+    pthread_mutex_lock(&data_mutex);
+    int fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end == (off_t)-1 || lseek(fd, 0, SEEK_SET) == (off_t)-1) {
+            close(fd);
+            fd = -1;
+        } else {
+            data_size = (uint64_t)end;
+        }
+    }
+    pthread_mutex_unlock(&data_mutex);
+
+    size_t header_at = conn->out.len;
+    char *payload = begin_response(conn, FRAME_GET_FD, fd == -1 ? FRAME_IO_ERROR : FRAME_OK,
+                                   fd == -1 ? 0 : 8);
+    if (payload == NULL) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    if (fd != -1) {
+        put_be64(payload, data_size);
+        conn->out.len += 8;
+        conn->pass_fd = fd;
+        conn->pass_fd_at = header_at;
+    }
+    return 0;
+}
+
+/**
+ * Answer a FRAME_FILTER request with the entries matching the @param len
+ * byte @param pattern, filtered by read_filtered_content().
+ */
+static int frame_filter(struct connection *conn, uint8_t mode, const char *pattern,
+                        uint32_t len) {
+    if (mode > AESD_FILTER_PREFIX || len > AESD_FILTER_MAX_PATTERN) {
+        return begin_response(conn, FRAME_FILTER, FRAME_BAD_PAYLOAD, 0) ? 0 : -1;
+    }
+    if (begin_response(conn, FRAME_FILTER, FRAME_OK, 0) == NULL) {
+        return -1;
+    }
+    size_t header_at = conn->out.len - FRAME_HEADER_SIZE;
+
+    uint64_t read_start = metrics_now_ns();
+    pthread_mutex_lock(&data_mutex);
+    int ret = read_filtered_content(conn, mode, pattern, len);
+    pthread_mutex_unlock(&data_mutex);
+    metrics_observe(METRIC_READ_BACK, metrics_now_ns() - read_start);
+
+    char *header = conn->out.data + header_at;
+    size_t total = conn->out.len - header_at - FRAME_HEADER_SIZE;
+    if (ret == -1 || total > FRAME_MAX_PAYLOAD) {
+        header[1] = (char)FRAME_IO_ERROR;
+        total = 0;
+        conn->out.len = header_at + FRAME_HEADER_SIZE;
+    }
+    uint32_t payload_len = htobe32((uint32_t)total);
+    memcpy(header + 4, &payload_len, sizeof(payload_len));
+    return 0;
+}
+
+/**
+ * Answer a FRAME_SEEK request with the history from byte
+ * @param write_cmd_offset of write command @param write_cmd on.
+ */
+static int frame_seek(struct connection *conn, uint32_t write_cmd, uint32_t write_cmd_offset) {
+    if (begin_response(conn, FRAME_SEEK, FRAME_OK, 0) == NULL) {
+        return -1;
+    }
+    size_t header_at = conn->out.len - FRAME_HEADER_SIZE;
+
+    uint64_t read_start = metrics_now_ns();
+    pthread_mutex_lock(&data_mutex);
+    int ret = read_content_from(conn, write_cmd, write_cmd_offset);
+    pthread_mutex_unlock(&data_mutex);
+    metrics_observe(METRIC_READ_BACK, metrics_now_ns() - read_start);
+
+    char *header = conn->out.data + header_at;
+    size_t total = conn->out.len - header_at - FRAME_HEADER_SIZE;
+    if (ret != 0 || total > FRAME_MAX_PAYLOAD) {
+        header[1] = (char)(ret == 1 ? FRAME_BAD_PAYLOAD : FRAME_IO_ERROR);
+        total = 0;
+        conn->out.len = header_at + FRAME_HEADER_SIZE;
+    }
+    uint32_t payload_len = htobe32((uint32_t)total);
+    memcpy(header + 4, &payload_len, sizeof(payload_len));
+    return 0;
+}
+
+/**
+ * Handle every complete frame in the input buffer of @param conn and queue
+ * one response for each.  A trailing partial frame stays buffered.
+ * @return 0 on success, -1 if the connection must be dropped (out of memory
+ * or a frame longer than FRAME_MAX_PAYLOAD).
+ */
+int process_frames(struct connection *conn) {
+    size_t start = 0;
+
+    while (conn->in.len - start >= FRAME_HEADER_SIZE) {
+        const char *header = conn->in.data + start;
+        uint8_t opcode = (uint8_t)header[0];
+        uint32_t len = get_be32(header + 4);
+        if (len > FRAME_MAX_PAYLOAD) {
+            fprintf(stderr, "Frame of %u bytes exceeds the limit, dropping client\n", len);
+            return -1;
+        }
+        if (conn->in.len - start < FRAME_HEADER_SIZE + (size_t)len) {
+            break;
+        }
+        const char *payload = header + FRAME_HEADER_SIZE;
+        size_t pending = conn->out.len - conn->out_sent;
+        int ret = 0;
+        conn->frames++;
+
+        switch (opcode) {
+            case FRAME_APPEND:
+                ret = begin_response(conn, opcode, frame_append(conn, payload, len), 0) ? 0 : -1;
+                break;
+            case FRAME_SEEK:
+                if (len != 8) {
+                    ret = begin_response(conn, opcode, FRAME_BAD_PAYLOAD, 0) ? 0 : -1;
+                } else {
+                    ret = frame_seek(conn, get_be32(payload), get_be32(payload + 4));
+                }
+                break;
+            case FRAME_READ_RANGE:
+                if (len != 12) {
+                    ret = begin_response(conn, opcode, FRAME_BAD_PAYLOAD, 0) ? 0 : -1;
+                } else {
+                    ret = frame_read_range(conn, get_be64(payload), get_be32(payload + 8));
+                }
+                break;
+            case FRAME_STATS:
+                ret = frame_stats(conn, pending);
+                break;
+            case FRAME_GET_FD:
+                ret = frame_get_fd(conn);
+                break;
+            case FRAME_FILTER:
+                if (len < 1) {
+                    ret = begin_response(conn, opcode, FRAME_BAD_PAYLOAD, 0) ? 0 : -1;
+                } else {
+                    ret = frame_filter(conn, (uint8_t)payload[0], payload + 1, len - 1);
+                }
+                break;
+            case FRAME_SUBSCRIBE:
+                ret = frame_subscribe(conn);
+                break;
+            default:
+                ret = begin_response(conn, opcode, FRAME_BAD_OPCODE, 0) ? 0 : -1;
+                break;
+        }
+        if (ret == -1) {
+            return -1;
+        }
+        start += FRAME_HEADER_SIZE + len;
+    }
+
+    memmove(conn->in.data, conn->in.data + start, conn->in.len - start);
+    conn->in.len -= start;
+    return 0;
+}
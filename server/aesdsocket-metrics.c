@@ -0,0 +1,326 @@
+/**
+ * @file aesdsocket-metrics.c
+ * @brief Per-thread counters and histograms for aesdsocket
+ *
+ * Each thread lazily allocates one cache-line aligned block of counters and
+ * histograms and is the only writer of it, using relaxed atomic stores so a
+ * concurrent scrape reads whole values.  Blocks sit on a registry list that
+ * is only locked when a thread starts, exits or a scrape walks it.  An
+ * exiting thread folds its values into the retired totals, so short-lived
+ * connection threads don't lose what they counted.
+ *
+ * Histograms use power of two nanosecond buckets: bucket i counts durations
+ * in [2^i, 2^(i+1)) ns and the last bucket is open ended.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesdsocket-metrics.h"
+
+#define METRICS_BUCKETS 32
+#define METRICS_BODY_SIZE 16384
+
+struct histogram {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+};
+
+struct thread_metrics {
+    uint64_t counters[METRIC_COUNTER_MAX];
+    struct histogram histograms[METRIC_HISTOGRAM_MAX];
+    struct thread_metrics *prev;
+    struct thread_metrics *next;
+} __attribute__((aligned(64)));
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTER_MAX] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = { "aesdsocket_connections_accepted_total",
+                                      "Client connections accepted." },
+    [METRIC_CONNECTIONS_CLOSED] = { "aesdsocket_connections_closed_total",
+                                    "Client connections closed." },
+    [METRIC_BYTES_IN] = { "aesdsocket_received_bytes_total", "Bytes received from clients." },
+    [METRIC_BYTES_OUT] = { "aesdsocket_sent_bytes_total", "Bytes sent to clients." },
+    [METRIC_RECORDS] = { "aesdsocket_records_total", "Newline terminated records processed." },
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} histogram_info[METRIC_HISTOGRAM_MAX] = {
+    [METRIC_LOCK_WAIT] = { "aesdsocket_data_lock_wait_seconds",
+                           "Time spent waiting to acquire data_mutex." },
+    [METRIC_RECV_TO_ACK] = { "aesdsocket_recv_to_ack_seconds",
+                             "Time from receiving a record to sending its response." },
+    [METRIC_READ_BACK] = { "aesdsocket_read_back_seconds",
+                           "Time to read the data file back for a response." },
+};
+
+static atomic_int metrics_enabled;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_metrics *registry;
+static struct thread_metrics retired;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+static __thread struct thread_metrics *local_metrics;
+
+static void fold_into(struct thread_metrics *dst, const struct thread_metrics *src) {
+    for (int c = 0; c < METRIC_COUNTER_MAX; c++) {
+        dst->counters[c] += __atomic_load_n(&src->counters[c], __ATOMIC_RELAXED);
+    }
+    for (int h = 0; h < METRIC_HISTOGRAM_MAX; h++) {
+        const struct histogram *s = &src->histograms[h];
+        struct histogram *d = &dst->histograms[h];
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            d->buckets[b] += __atomic_load_n(&s->buckets[b], __ATOMIC_RELAXED);
+        }
+        d->count += __atomic_load_n(&s->count, __ATOMIC_RELAXED);
+        d->sum_ns += __atomic_load_n(&s->sum_ns, __ATOMIC_RELAXED);
+    }
+}
+
+static void thread_metrics_retire(void *arg) {
+    struct thread_metrics *m = arg;
+
+    pthread_mutex_lock(&registry_mutex);
+    fold_into(&retired, m);
+    if (m->prev != NULL) {
+        m->prev->next = m->next;
+    } else {
+        registry = m->next;
+    }
+    if (m->next != NULL) {
+        m->next->prev = m->prev;
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    free(m);
+}
+
+static void metrics_key_create(void) {
+    pthread_key_create(&metrics_key, thread_metrics_retire);
+}
+
+static struct thread_metrics *thread_metrics_get(void) {
+    if (local_metrics != NULL) {
+        return local_metrics;
+    }
+
+    struct thread_metrics *m = aligned_alloc(64, sizeof(struct thread_metrics));
+    if (m == NULL) {
+        return NULL;
+    }
+    memset(m, 0, sizeof(*m));
+
+    pthread_once(&metrics_key_once, metrics_key_create);
+    pthread_setspecific(metrics_key, m);
+
+    pthread_mutex_lock(&registry_mutex);
+    m->next = registry;
+    if (registry != NULL) {
+        registry->prev = m;
+    }
+    registry = m;
+    pthread_mutex_unlock(&registry_mutex);
+
+    local_metrics = m;
+    return m;
+}
+
+/* Single writer per block: a relaxed load and store is enough */
+static inline void bump(uint64_t *value, uint64_t delta) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + delta, __ATOMIC_RELAXED);
+}
+
+void metrics_add(enum metrics_counter counter, uint64_t value) {
+    if (!atomic_load_explicit(&metrics_enabled, memory_order_relaxed)) {
+        return;
+    }
+    struct thread_metrics *m = thread_metrics_get();
+    if (m != NULL) {
+        bump(&m->counters[counter], value);
+    }
+}
+
+void metrics_observe(enum metrics_histogram histogram, uint64_t ns) {
+    if (!atomic_load_explicit(&metrics_enabled, memory_order_relaxed)) {
+        return;
+    }
+    struct thread_metrics *m = thread_metrics_get();
+    if (m == NULL) {
+        return;
+    }
+
+    int bucket = 63 - __builtin_clzll(ns | 1);
+    if (bucket >= METRICS_BUCKETS) {
+        bucket = METRICS_BUCKETS - 1;
+    }
+    struct histogram *h = &m->histograms[histogram];
+    bump(&h->buckets[bucket], 1);
+    bump(&h->count, 1);
+    bump(&h->sum_ns, ns);
+}
+
+uint64_t metrics_now_ns(void) {
+    if (!atomic_load_explicit(&metrics_enabled, memory_order_relaxed)) {
+        return 0;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int metrics_listen(const char *addr) {
+    int fd;
+
+    if (addr[0] == '/' || addr[0] == '@') {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        size_t len = strlen(addr);
+        if (len >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "Metrics socket path too long: %s\n", addr);
+            return -1;
+        }
+        memcpy(sun.sun_path, addr, len);
+        if (addr[0] == '@') {
+            sun.sun_path[0] = '\0';
+        } else {
+            unlink(addr);
+        }
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd == -1 ||
+            bind(fd, (struct sockaddr *)&sun, offsetof(struct sockaddr_un, sun_path) + len) == -1) {
+            perror("metrics bind");
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+    } else {
+        struct sockaddr_in sin;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(atoi(addr));
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        if (fd == -1 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1 ||
+            bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1) {
+            perror("metrics bind");
+            if (fd != -1) {
+                close(fd);
+            }
+            return -1;
+        }
+    }
+
+    if (listen(fd, 16) == -1) {
+        perror("metrics listen");
+        close(fd);
+        return -1;
+    }
+    atomic_store(&metrics_enabled, 1);
+    return fd;
+}
+
+static size_t render(char *body, size_t size) {
+    struct thread_metrics total;
+    size_t len = 0;
+
+    pthread_mutex_lock(&registry_mutex);
+    total = retired;
+    for (struct thread_metrics *m = registry; m != NULL; m = m->next) {
+        fold_into(&total, m);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+
+#define EMIT(...)                                                                  \
+    do {                                                                           \
+        int n = snprintf(body + len, size - len, __VA_ARGS__);                     \
+        if (n > 0) {                                                               \
+            len = (size_t)n < size - len ? len + n : size - 1;                     \
+        }                                                                          \
+    } while (0)
+
+    for (int c = 0; c < METRIC_COUNTER_MAX; c++) {
+        EMIT("# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[c].name,
+             counter_info[c].help, counter_info[c].name, counter_info[c].name,
+             (unsigned long long)total.counters[c]);
+    }
+
+    EMIT("# HELP aesdsocket_active_connections Client connections currently open.\n"
+         "# TYPE aesdsocket_active_connections gauge\n"
+         "aesdsocket_active_connections %llu\n",
+         (unsigned long long)(total.counters[METRIC_CONNECTIONS_ACCEPTED] -
+                              total.counters[METRIC_CONNECTIONS_CLOSED]));
+
+    for (int h = 0; h < METRIC_HISTOGRAM_MAX; h++) {
+        const char *name = histogram_info[h].name;
+        const struct histogram *hist = &total.histograms[h];
+        uint64_t cumulative = 0;
+
+        EMIT("# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[h].help, name);
+        for (int b = 0; b < METRICS_BUCKETS - 1; b++) {
+            cumulative += hist->buckets[b];
+            EMIT("%s_bucket{le=\"%.9g\"} %llu\n", name, (double)(1ull << (b + 1)) / 1e9,
+                 (unsigned long long)cumulative);
+        }
+        EMIT("%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n", name,
+             (unsigned long long)hist->count, name, (double)hist->sum_ns / 1e9, name,
+             (unsigned long long)hist->count);
+    }
+#undef EMIT
+
+    return len;
+}
+
+void metrics_serve(int listen_fd) {
+    int client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (client == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("metrics accept");
+        }
+        return;
+    }
+
+    /* A scrape must never stall the event loop it is served from */
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    /* The request itself doesn't matter: every path gets the full exposition */
+    char request[1024];
+    if (recv(client, request, sizeof(request), 0) == -1) {
+        close(client);
+        return;
+    }
+
+    char *body = malloc(METRICS_BODY_SIZE);
+    if (body != NULL) {
+        size_t len = render(body, METRICS_BODY_SIZE);
+        char header[128];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.0 200 OK\r\n"
+                                  "Content-Type: text/plain; version=0.0.4\r\n"
+                                  "Content-Length: %zu\r\n\r\n",
+                                  len);
+        if (send(client, header, header_len, MSG_NOSIGNAL) == header_len) {
+            send(client, body, len, MSG_NOSIGNAL);
+        }
+        free(body);
+    }
+    close(client);
+}
@@ -0,0 +1,65 @@
+/*
+ * aesdsocket-metrics.h
+ *
+ * Low overhead counters and latency histograms for aesdsocket, exposed in
+ * the Prometheus text exposition format.
+ */
+
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include <stdint.h>
+
+enum metrics_counter {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_RECORDS,
+    METRIC_COUNTER_MAX,
+};
+
+enum metrics_histogram {
+    /* Time spent waiting to acquire data_mutex */
+    METRIC_LOCK_WAIT,
+    /* From the receive completing a line to its response being sent */
+    METRIC_RECV_TO_ACK,
+    /* Time to read the data file back for a response */
+    METRIC_READ_BACK,
+    METRIC_HISTOGRAM_MAX,
+};
+
+/**
+ * Add @param value to counter @param counter of the calling thread.  Every
+ * thread updates only its own cache-line aligned block, so the hot path never
+ * shares a written cache line with another thread.
+ */
+void metrics_add(enum metrics_counter counter, uint64_t value);
+
+/**
+ * Record a duration of @param ns nanoseconds in histogram @param histogram
+ * of the calling thread.
+ */
+void metrics_observe(enum metrics_histogram histogram, uint64_t ns);
+
+/**
+ * @return a monotonic timestamp in nanoseconds, or 0 when metrics are off so
+ * callers skip the clock read entirely.
+ */
+uint64_t metrics_now_ns(void);
+
+/**
+ * Open the exposition endpoint described by @param addr: a path starting
+ * with '/' (or '@' for the abstract namespace) is a Unix socket, anything
+ * else a TCP port on the loopback interface.  Enables collection.
+ * @return the listening descriptor, or -1 on error.
+ */
+int metrics_listen(const char *addr);
+
+/**
+ * Accept one pending scrape on @param listen_fd and answer it with the
+ * current values summed across all threads.
+ */
+void metrics_serve(int listen_fd);
+
+#endif /* AESDSOCKET_METRICS_H */
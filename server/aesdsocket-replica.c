@@ -0,0 +1,739 @@
+/**
+ * @file aesdsocket-replica.c
+ * @brief Read replicas: streaming committed records to followers
+ *
+ * Any instance can be subscribed to with FRAME_SUBSCRIBE.  A subscriber
+ * gets a snapshot of the history, then every record as it is committed, in
+ * commit order, since both are taken under data_mutex.  A primary running
+ * the io_uring engine appends without it, so it refuses subscriptions; and a
+ * write that fails, maybe part-way, drops every subscriber to resync.  Records queue on the
+ * subscriber and its handler thread, woken through an eventfd, moves them to
+ * its output buffer; a subscriber more than SUBSCRIBER_BACKLOG_LIMIT bytes
+ * behind is dropped rather than buffered for without bound.
+ *
+ * An instance started with -f is a follower: a thread subscribes to the
+ * primary, reconnecting whenever the stream breaks, and keeps a copy of the
+ * history in the replica file its clients read back.
+ *
+ * Each write is streamed as one FRAME_RECORD.  When the history is limited,
+ * as aesdchar's ten entries are, both ends mirror it entry by entry the way
+ * the driver builds them: a write ending in a newline closes an entry,
+ * along with any unterminated writes before it.  A primary's snapshot sends
+ * each entry as one record, so its followers drop the same entries it does,
+ * whatever their lines.  Entries already in the device when the primary
+ * starts can only be told apart by their lines.  Followers don't take writes,
+ * so all of them apply the records in the primary's order; a follower
+ * streams what it applies to its own subscribers, so they can be chained.
+ */
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "aesdsocket.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+
+#define SUBSCRIBER_BACKLOG_LIMIT (64 * 1024 * 1024)
+#define SNAPSHOT_CHUNK (64 * 1024)
+#define FOLLOWER_POLL_MS 100
+#define FOLLOWER_RETRY_MS 1000
+#define PRIMARY_DEFAULT_HOST "127.0.0.1"
+
+struct subscriber {
+    int wake_fd;
+    /* Framed records not yet collected by the handler, under data_mutex */
+    struct io_buffer pending;
+    int dropped;
+    struct subscriber *prev;
+    struct subscriber *next;
+};
+
+/* Under data_mutex */
+static struct subscriber *subscribers;
+
+/* Entries the history keeps; a follower takes its primary's */
+#ifdef USE_AESD_CHAR_DEVICE
+static uint32_t history_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+#else
+static uint32_t history_entries = 0;
+#endif
+
+/*
+ * With a limited history, its mirror, under data_mutex: the bytes of the
+ * entry_count entries kept, the entry_lens[] of each, then the pending_len
+ * bytes of unterminated writes, which the driver doesn't show yet.  Invalid
+ * until seeded, and after a write of unknown outcome.
+ */
+static struct io_buffer history;
+static size_t *entry_lens;
+static uint32_t entry_count;
+static size_t pending_len;
+static int history_valid;
+/* An entry was dropped since the follower last wrote out its replica */
+static int history_evicted;
+
+static void put_header(char *header, uint8_t opcode, uint8_t status, uint32_t payload_len) {
+    uint32_t len = htobe32(payload_len);
+    header[0] = (char)opcode;
+    header[1] = (char)status;
+    header[2] = 0;
+    header[3] = 0;
+    memcpy(header + 4, &len, sizeof(len));
+}
+
+/**
+ * Add the @param len byte write at @param data to the history mirror,
+ * dropping its oldest entry if the write closes one past history_entries.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int history_append(const char *data, size_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (buffer_reserve(&history, len) == -1) {
+        return -1;
+    }
+    memcpy(history.data + history.len, data, len);
+    history.len += len;
+    pending_len += len;
+    if (data[len - 1] != '\n') {
+        return 0;
+    }
+
+    if (entry_count == history_entries) {
+        size_t oldest = entry_lens[0];
+        memmove(history.data, history.data + oldest, history.len - oldest);
+        history.len -= oldest;
+        memmove(entry_lens, entry_lens + 1, (entry_count - 1) * sizeof(*entry_lens));
+        entry_count--;
+        history_evicted = 1;
+    }
+    entry_lens[entry_count++] = pending_len;
+    pending_len = 0;
+    return 0;
+}
+
+/**
+ * Empty the mirror, for a history of @param entries entries.  It stays
+ * invalid until the caller fills it.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int history_reset(uint32_t entries) {
+    history.len = 0;
+    entry_count = 0;
+    pending_len = 0;
+    history_valid = 0;
+    history_evicted = 0;
+    history_entries = entries;
+    if (entries == 0) {
+        return 0;
+    }
+    size_t *lens = realloc(entry_lens, entries * sizeof(*entry_lens));
+    if (lens == NULL) {
+        return -1;
+    }
+    entry_lens = lens;
+    return 0;
+}
+
+int history_seed(void) {
+    if (history_entries == 0) {
+        return 0;
+    }
+    if (history_reset(history_entries) == -1) {
+        return -1;
+    }
+
+    int fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    struct io_buffer content = { 0 };
+    ssize_t bytes_read;
+    do {
+        if (buffer_reserve(&content, SNAPSHOT_CHUNK) == -1) {
+            bytes_read = -1;
+            break;
+        }
+        bytes_read = read(fd, content.data + content.len, content.cap - content.len);
+        if (bytes_read > 0) {
+            content.len += bytes_read;
+        }
+    } while (bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
+    close(fd);
+
+    /* The driver only shows what the entries hold, so take each line as one */
+    size_t start = 0;
+    while (bytes_read == 0 && start < content.len) {
+        char *newline = memchr(content.data + start, '\n', content.len - start);
+        size_t end = newline != NULL ? (size_t)(newline - content.data) + 1 : content.len;
+        if (history_append(content.data + start, end - start) == -1) {
+            bytes_read = -1;
+        }
+        start = end;
+    }
+    free(content.data);
+    history_valid = bytes_read == 0;
+    return history_valid ? 0 : -1;
+}
+
+/**
+ * Queue each entry of the history mirror on @param conn as one FRAME_RECORD
+ * frame, then the unterminated writes after them as one more.  Called with
+ * data_mutex held.
+ * @return 0 on success, -1 on error.
+ */
+static int queue_entries(struct connection *conn) {
+    if (!history_valid && (primary_addr != NULL || history_seed() == -1)) {
+        return -1;
+    }
+    if (buffer_reserve(&conn->out, (entry_count + 1) * FRAME_HEADER_SIZE + history.len) == -1) {
+        return -1;
+    }
+
+    size_t at = 0;
+    for (uint32_t i = 0; i <= entry_count; i++) {
+        size_t len = i < entry_count ? entry_lens[i] : pending_len;
+        if (len == 0) {
+            continue;
+        }
+        put_header(conn->out.data + conn->out.len, FRAME_RECORD, FRAME_OK, len);
+        memcpy(conn->out.data + conn->out.len + FRAME_HEADER_SIZE, history.data + at, len);
+        conn->out.len += FRAME_HEADER_SIZE + len;
+        at += len;
+    }
+    return 0;
+}
+
+/**
+ * Queue the whole of data_path on @param conn as FRAME_RECORD frames: one
+ * per entry with a limited history, else of up to SNAPSHOT_CHUNK bytes.
+ * Called with data_mutex held.
+ * @return 0 on success, -1 on error.
+ */
+static int queue_snapshot(struct connection *conn) {
+    if (history_entries > 0) {
+        return queue_entries(conn);
+    }
+
+    int fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    ssize_t bytes_read;
+    do {
+        if (buffer_reserve(&conn->out, FRAME_HEADER_SIZE + SNAPSHOT_CHUNK) == -1) {
+            close(fd);
+            return -1;
+        }
+        char *header = conn->out.data + conn->out.len;
+        bytes_read = read(fd, header + FRAME_HEADER_SIZE, SNAPSHOT_CHUNK);
+        if (bytes_read > 0) {
+            put_header(header, FRAME_RECORD, FRAME_OK, bytes_read);
+            conn->out.len += FRAME_HEADER_SIZE + bytes_read;
+        }
+    } while (bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
+
+    close(fd);
+    return bytes_read == 0 ? 0 : -1;
+}
+
+int frame_subscribe(struct connection *conn) {
+    /* A follower's appends all come from its own stream, under data_mutex */
+    int unordered = atomic_load(&use_uring) && primary_addr == NULL;
+    if (!conn->threaded || unordered || conn->subscriber != NULL) {
+        if (buffer_reserve(&conn->out, FRAME_HEADER_SIZE) == -1) {
+            return -1;
+        }
+        put_header(conn->out.data + conn->out.len, FRAME_SUBSCRIBE,
+                   conn->subscriber != NULL ? FRAME_IO_ERROR : FRAME_UNSUPPORTED, 0);
+        conn->out.len += FRAME_HEADER_SIZE;
+        return 0;
+    }
+
+    struct subscriber *sub = calloc(1, sizeof(*sub));
+    if (sub == NULL) {
+        return -1;
+    }
+    sub->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (sub->wake_fd == -1) {
+        perror("eventfd");
+        free(sub);
+        return -1;
+    }
+    if (buffer_reserve(&conn->out, FRAME_HEADER_SIZE + 4) == -1) {
+        close(sub->wake_fd);
+        free(sub);
+        return -1;
+    }
+
+    size_t header_at = conn->out.len;
+    conn->out.len += FRAME_HEADER_SIZE + 4;
+    pthread_mutex_lock(&data_mutex);
+    uint32_t entries = history_entries;
+    uint32_t entries_be = htobe32(entries);
+    memcpy(conn->out.data + header_at + FRAME_HEADER_SIZE, &entries_be, sizeof(entries_be));
+    if (queue_snapshot(conn) == -1) {
+        pthread_mutex_unlock(&data_mutex);
+        conn->out.len = header_at + FRAME_HEADER_SIZE;
+        put_header(conn->out.data + header_at, FRAME_SUBSCRIBE, FRAME_IO_ERROR, 0);
+        close(sub->wake_fd);
+        free(sub);
+        return 0;
+    }
+    put_header(conn->out.data + header_at, FRAME_SUBSCRIBE, FRAME_OK, 4);
+    sub->next = subscribers;
+    if (subscribers != NULL) {
+        subscribers->prev = sub;
+    }
+    subscribers = sub;
+    pthread_mutex_unlock(&data_mutex);
+
+    conn->subscriber = sub;
+    syslog(LOG_INFO, "Subscriber on fd %d, history of %u entries", conn->client_socket, entries);
+    return 0;
+}
+
+static void wake_subscriber(struct subscriber *sub) {
+    uint64_t one = 1;
+    if (write(sub->wake_fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+        perror("write wake_fd");
+    }
+}
+
+void replicate(const struct iovec *iov, int iovcnt) {
+    /* A follower mirrors what it applies in replica_apply() */
+    if (history_valid && primary_addr == NULL) {
+        for (int i = 0; i < iovcnt && history_valid; i++) {
+            if (history_append(iov[i].iov_base, iov[i].iov_len) == -1) {
+                /* The next subscriber reseeds it from the device */
+                history_valid = 0;
+            }
+        }
+    }
+    if (subscribers == NULL) {
+        return;
+    }
+
+    size_t len = 0;
+    int records = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+        records += iov[i].iov_len > 0;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    /* One record per write, as each is one device entry */
+    size_t frames_len = (size_t)records * FRAME_HEADER_SIZE + len;
+    for (struct subscriber *sub = subscribers; sub != NULL; sub = sub->next) {
+        if (sub->dropped) {
+            continue;
+        }
+        int was_empty = sub->pending.len == 0;
+        if (sub->pending.len + frames_len > SUBSCRIBER_BACKLOG_LIMIT ||
+            buffer_reserve(&sub->pending, frames_len) == -1) {
+            sub->dropped = 1;
+            free(sub->pending.data);
+            sub->pending = (struct io_buffer){ 0 };
+            wake_subscriber(sub);
+            continue;
+        }
+        for (int i = 0; i < iovcnt; i++) {
+            if (iov[i].iov_len == 0) {
+                continue;
+            }
+            char *header = sub->pending.data + sub->pending.len;
+            put_header(header, FRAME_RECORD, FRAME_OK, iov[i].iov_len);
+            memcpy(header + FRAME_HEADER_SIZE, iov[i].iov_base, iov[i].iov_len);
+            sub->pending.len += FRAME_HEADER_SIZE + iov[i].iov_len;
+        }
+        if (was_empty) {
+            wake_subscriber(sub);
+        }
+    }
+}
+
+/**
+ * Drop every subscriber, waking each so its handler notices.  Called with
+ * data_mutex held.
+ */
+static void drop_subscribers(void) {
+    for (struct subscriber *sub = subscribers; sub != NULL; sub = sub->next) {
+        if (!sub->dropped) {
+            sub->dropped = 1;
+            free(sub->pending.data);
+            sub->pending = (struct io_buffer){ 0 };
+            wake_subscriber(sub);
+        }
+    }
+}
+
+void replicate_failed(void) {
+    /* Whatever part of the write was committed, the mirror no longer knows it */
+    if (primary_addr == NULL) {
+        history_valid = 0;
+    }
+    if (subscribers != NULL) {
+        syslog(LOG_WARNING, "A write failed, dropping every subscriber to resync");
+        drop_subscribers();
+    }
+}
+
+int subscriber_wake_fd(const struct connection *conn) {
+    return conn->subscriber->wake_fd;
+}
+
+int subscriber_collect(struct connection *conn) {
+    struct subscriber *sub = conn->subscriber;
+    uint64_t count;
+    int ret = 0;
+
+    if (read(sub->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read wake_fd");
+    }
+
+    pthread_mutex_lock(&data_mutex);
+    if (sub->dropped) {
+        syslog(LOG_WARNING, "Dropping subscriber on fd %d", conn->client_socket);
+        ret = -1;
+    } else if (sub->pending.len > 0) {
+        if (buffer_reserve(&conn->out, sub->pending.len) == -1) {
+            ret = -1;
+        } else {
+            memcpy(conn->out.data + conn->out.len, sub->pending.data, sub->pending.len);
+            conn->out.len += sub->pending.len;
+            sub->pending.len = 0;
+        }
+    }
+    pthread_mutex_unlock(&data_mutex);
+    return ret;
+}
+
+void subscriber_remove(struct connection *conn) {
+    struct subscriber *sub = conn->subscriber;
+    if (sub == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&data_mutex);
+    if (sub->prev != NULL) {
+        sub->prev->next = sub->next;
+    } else {
+        subscribers = sub->next;
+    }
+    if (sub->next != NULL) {
+        sub->next->prev = sub->prev;
+    }
+    pthread_mutex_unlock(&data_mutex);
+
+    close(sub->wake_fd);
+    free(sub->pending.data);
+    free(sub);
+    conn->subscriber = NULL;
+}
+
+static pthread_t follower_tid;
+/* With a limited history, the bytes of the mirror the replica file holds */
+static size_t replica_len;
+
+/**
+ * Connect to @param addr: a Unix socket /path or @abstract name, or a TCP
+ * host:port or bare port on PRIMARY_DEFAULT_HOST.
+ * @return the connected socket, or -1.
+ */
+static int connect_primary(const char *addr) {
+    if (addr[0] == '/' || addr[0] == '@') {
+        struct sockaddr_un address;
+        size_t len = strlen(addr);
+        if (len >= sizeof(address.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, addr, len);
+        if (addr[0] == '@') {
+            address.sun_path[0] = '\0';
+        }
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 &&
+            connect(fd, (struct sockaddr *)&address, offsetof(struct sockaddr_un, sun_path) + len) ==
+                    -1) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    char host[256];
+    const char *port = strrchr(addr, ':');
+    if (port == NULL) {
+        snprintf(host, sizeof(host), "%s", PRIMARY_DEFAULT_HOST);
+        port = addr;
+    } else {
+        snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+        port++;
+    }
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    int err = getaddrinfo(host, port, &hints, &res);
+    if (err != 0) {
+        syslog(LOG_ERR, "Primary %s: %s", addr, gai_strerror(err));
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai != NULL && fd == -1; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/**
+ * Start the replica over for a primary keeping @param entries entries.
+ * Called with data_mutex held.
+ * @return 0 on success, -1 if out of memory.
+ */
+static int replica_reset(uint32_t entries) {
+    /* Our own subscribers have the old copy; make them start over too */
+    drop_subscribers();
+    if (ftruncate(data_fd, 0) == -1) {
+        perror("ftruncate");
+    }
+    replica_len = 0;
+    if (history_reset(entries) == -1) {
+        return -1;
+    }
+    history_valid = 1;
+    return 0;
+}
+
+/**
+ * Apply the @param len byte record at @param data, one write on the
+ * primary, to the replica.  With a limited history it only goes to the
+ * mirror; replica_flush() writes that out.  Called with data_mutex held.
+ */
+static int replica_apply(const char *data, size_t len) {
+    if (history_entries == 0) {
+        if (write(data_fd, data, len) != (ssize_t)len) {
+            perror("write");
+            return -1;
+        }
+    } else if (history_append(data, len) == -1) {
+        history_valid = 0;
+        return -1;
+    }
+
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    replicate(&iov, 1);
+    return 0;
+}
+
+/**
+ * Bring the replica up to the entries of the history mirror, leaving out
+ * the unterminated writes after them as the driver does.  New entries are
+ * appended; once one was dropped, the entries are written to a new file
+ * renamed over the replica, so a reader holding it never finds it cut
+ * short.  A follower's io_uring engine reads back through process_lines(),
+ * never through the descriptor it registered, so that can go stale.
+ * Called with data_mutex held.
+ */
+static int replica_flush(void) {
+    if (history_entries == 0) {
+        return 0;
+    }
+
+    size_t complete = history.len - pending_len;
+    if (!history_evicted) {
+        size_t len = complete - replica_len;
+        if (len > 0 && write(data_fd, history.data + replica_len, len) != (ssize_t)len) {
+            perror("write");
+            return -1;
+        }
+        replica_len = complete;
+        return 0;
+    }
+
+    char path[128];
+    snprintf(path, sizeof(path), "%s.new", data_path);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+    if ((complete > 0 && write(fd, history.data, complete) != (ssize_t)complete) ||
+        rename(path, data_path) == -1) {
+        perror("rewrite replica");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    close(data_fd);
+    data_fd = fd;
+    replica_len = complete;
+    history_evicted = 0;
+    return 0;
+}
+
+/**
+ * Apply every complete frame in @param in, starting after the magic byte.
+ * @return 0 on success, -1 if the stream is broken.
+ */
+static int apply_frames(struct io_buffer *in, int *subscribed) {
+    size_t start = 1;
+    int ret = 0;
+
+    pthread_mutex_lock(&data_mutex);
+    while (in->len - start >= FRAME_HEADER_SIZE) {
+        const char *header = in->data + start;
+        uint32_t len;
+        memcpy(&len, header + 4, sizeof(len));
+        len = be32toh(len);
+        if (len > FRAME_MAX_PAYLOAD) {
+            ret = -1;
+            break;
+        }
+        if (in->len - start < FRAME_HEADER_SIZE + (size_t)len) {
+            break;
+        }
+        const char *payload = header + FRAME_HEADER_SIZE;
+        start += FRAME_HEADER_SIZE + len;
+
+        if ((uint8_t)header[0] == FRAME_SUBSCRIBE) {
+            uint32_t entries;
+            if (header[1] != FRAME_OK || len != 4) {
+                syslog(LOG_ERR, "Primary refused the subscription, status %d", header[1]);
+                ret = -1;
+                break;
+            }
+            memcpy(&entries, payload, sizeof(entries));
+            if (replica_reset(be32toh(entries)) == -1) {
+                ret = -1;
+                break;
+            }
+            *subscribed = 1;
+        } else if ((uint8_t)header[0] == FRAME_RECORD && *subscribed) {
+            if (replica_apply(payload, len) == -1) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (replica_flush() == -1) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&data_mutex);
+
+    memmove(in->data + 1, in->data + start, in->len - start);
+    in->len -= start - 1;
+    return ret;
+}
+
+/**
+ * Subscribe on the connected socket @param fd and apply the stream until it
+ * breaks or the server shuts down.
+ */
+static void follow(int fd) {
+    char request[1 + FRAME_HEADER_SIZE];
+    struct io_buffer in = { 0 };
+    int subscribed = 0;
+
+    request[0] = (char)FRAME_MAGIC;
+    put_header(request + 1, FRAME_SUBSCRIBE, FRAME_OK, 0);
+    if (send(fd, request, sizeof(request), MSG_NOSIGNAL) != (ssize_t)sizeof(request)) {
+        perror("send subscribe");
+        return;
+    }
+
+    while (atomic_load(&server_running)) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, FOLLOWER_POLL_MS);
+        if (ready == -1 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+
+        if (buffer_reserve(&in, 64 * 1024) == -1) {
+            break;
+        }
+        ssize_t bytes_received = recv(fd, in.data + in.len, in.cap - in.len, 0);
+        if (bytes_received == 0) {
+            syslog(LOG_WARNING, "Primary %s closed the stream", primary_addr);
+            break;
+        }
+        if (bytes_received == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            syslog(LOG_WARNING, "Primary %s: %s", primary_addr, strerror(errno));
+            break;
+        }
+        in.len += bytes_received;
+        if ((unsigned char)in.data[0] != FRAME_MAGIC) {
+            syslog(LOG_ERR, "Primary %s doesn't speak the framed protocol", primary_addr);
+            break;
+        }
+        if (apply_frames(&in, &subscribed) == -1) {
+            break;
+        }
+    }
+    free(in.data);
+}
+
+static void *follower_thread(void *arg) {
+    (void)arg;
+
+    while (atomic_load(&server_running)) {
+        int fd = connect_primary(primary_addr);
+        if (fd != -1) {
+            syslog(LOG_INFO, "Following primary %s", primary_addr);
+            follow(fd);
+            close(fd);
+        }
+        /* Wait before retrying, but notice shutdown promptly */
+        for (int waited = 0; waited < FOLLOWER_RETRY_MS && atomic_load(&server_running);
+             waited += FOLLOWER_POLL_MS) {
+            poll(NULL, 0, FOLLOWER_POLL_MS);
+        }
+    }
+    free(history.data);
+    free(entry_lens);
+    return NULL;
+}
+
+int follower_start(void) {
+    int err = pthread_create(&follower_tid, NULL, follower_thread, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+void follower_stop(void) {
+    pthread_join(follower_tid, NULL);
+}
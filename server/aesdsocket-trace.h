@@ -0,0 +1,53 @@
+/*
+ * aesdsocket-trace.h
+ *
+ * USDT probes following each record through aesdsocket, under the provider
+ * "aesdsocket".  They come from <sys/sdt.h> (systemtap-sdt-dev) when the
+ * build has it: each probe is then a nop plus an ELF note until perf,
+ * bpftrace or systemtap attaches to it.  Without the header they compile to
+ * nothing.
+ *
+ *   recv(fd, bytes)               recv() returned bytes from a client
+ *   record_start(id, fd, len)     a complete line or append frame is taken
+ *   record_locked(id)             data_mutex is held for it
+ *   record_written(id, result)    write() of DATA_FILE returned result
+ *   record_read_back(id, bytes)   DATA_FILE was read back for the response
+ *   send(fd, bytes)               send() queued bytes of responses
+ *
+ * Record ids are unique across the process, and server/aesd-trace.sh keys
+ * each record's stages on its id.  The aesdchar tracepoints can't carry it;
+ * a record's fire on its own thread between record_locked and
+ * record_read_back (record_written for append frames, which aren't read
+ * back), so they are joined to the record that thread has in flight.  The
+ * io_uring engine writes and reads asynchronously, off the calling thread,
+ * so it fires only recv and send, as do coalesced (-r batch) text lines.
+ */
+
+#ifndef AESDSOCKET_TRACE_H
+#define AESDSOCKET_TRACE_H
+
+#include <stdint.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define AESD_HAVE_SDT 1
+#endif
+#endif
+
+#ifdef AESD_HAVE_SDT
+#define AESD_PROBE1(name, a) DTRACE_PROBE1(aesdsocket, name, a)
+#define AESD_PROBE2(name, a, b) DTRACE_PROBE2(aesdsocket, name, a, b)
+#define AESD_PROBE3(name, a, b, c) DTRACE_PROBE3(aesdsocket, name, a, b, c)
+#else
+#define AESD_PROBE1(name, a) ((void)(a))
+#define AESD_PROBE2(name, a, b) ((void)(a), (void)(b))
+#define AESD_PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+
+/**
+ * @return a new record id, never handed out before by this process.
+ */
+uint64_t trace_next_record_id(void);
+
+#endif /* AESDSOCKET_TRACE_H */
@@ -0,0 +1,856 @@
+/**
+ * @file aesdsocket-uring.c
+ * @brief io_uring engine for aesdsocket, selected with "-e uring"
+ *
+ * A single thread drives every connection through one ring, built on the raw
+ * io_uring syscalls so no extra library is needed on the target:
+ *  - one multishot accept on the listening socket
+ *  - socket receives with READ_FIXED into per-connection registered buffers
+ *  - data file appends and read-backs on registered (fixed) data file
+ *    descriptors, the appends of one batch linked so they commit in order
+ *  - sends straight from the connection output buffer
+ *  - the periodic timerfd, the shutdown signalfd and the metrics endpoint
+ *    as multishot polls
+ * Everything queued while handling one batch of completions goes to the
+ * kernel in a single io_uring_enter() call.
+ *
+ * Each connection has at most one operation (or one linked chain of appends)
+ * in flight at a time: receive, commit the complete lines, read the data file
+ * back, send it, receive again.  All lines from one receive are committed as
+ * a batch and answered with a single read-back.  A batch carrying an
+ * AESDCHAR_IOCSEEKTO or AESDCHAR_IOCFILTER command is handled synchronously
+ * by process_lines(), since the seek and the filter both answer through an
+ * ioctl on a descriptor of their own, and so are binary protocol frames, by
+ * process_frames().
+ *
+ * uring_engine_run() returns -1 without side effects when the kernel lacks a
+ * required feature, and the caller falls back to the epoll engine.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "aesdsocket.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-trace.h"
+
+#define URING_ENTRIES 256
+#define URING_RECV_BUF_SIZE 4096
+#define URING_MAX_SLOTS 1024
+#define URING_READ_CHUNK (64 * 1024)
+#define URING_OVERFLOW 4096
+
+/* Registered file indexes of the data file */
+#define FIXED_DATA_WRITE 0
+#define FIXED_DATA_READ 1
+
+/* user_data layout: operation in the top byte, connection slot below */
+enum uring_op {
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_WRITE,
+    OP_READ,
+    OP_SEND,
+    OP_TIMER,
+    OP_SIGNAL,
+    OP_DEADLINE,
+    OP_CANCEL,
+    OP_METRICS,
+};
+
+#define USER_DATA(op, slot) (((uint64_t)(op) << 56) | (uint64_t)(slot))
+#define USER_DATA_OP(data) ((enum uring_op)((data) >> 56))
+#define USER_DATA_SLOT(data) ((unsigned int)((data) & 0xffffffffu))
+
+struct uring {
+    int fd;
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_local_tail;
+    unsigned int to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+struct uring_conn {
+    struct connection conn;
+    int in_use;
+    /* Appends of the current batch still in flight, and the bytes they wrote */
+    unsigned int writes_pending;
+    size_t bytes_written;
+    int write_failed;
+    /* Bytes at the front of conn.in covered by the current batch */
+    size_t batch_len;
+    off_t read_offset;
+    /* metrics_now_ns() stamps for the recv-to-ack and read-back histograms */
+    uint64_t received_at;
+    uint64_t read_started;
+    unsigned int next_free;
+};
+
+static struct uring ring;
+static struct uring_conn *slots;
+static unsigned int num_slots;
+static unsigned int free_head;
+static unsigned int active_conns;
+static char *recv_buffers;
+static int listen_fd;
+static int data_read_fd = -1;
+static int accept_armed;
+/*
+ * Clients the multishot accept handed us after the slots ran out, before the
+ * cancel took effect; a burst can drain the whole kernel backlog at once.
+ * They are served in arrival order as slots free up rather than reset.
+ */
+static int *overflow_fds;
+static unsigned int overflow_head;
+static unsigned int overflow_count;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                              unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, const void *arg,
+                                 unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_setup(struct uring *r, unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    r->fd = sys_io_uring_setup(entries, &params);
+    if (r->fd == -1) {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_RW_CUR_POS)) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (r->cq_ring_size > r->sq_ring_size) {
+        r->sq_ring_size = r->cq_ring_size;
+    }
+    r->cq_ring_size = r->sq_ring_size;
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->cq_ring = r->sq_ring;
+
+    r->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->sq_ring, r->sq_ring_size);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = r->sq_ring;
+    r->sq_entries = params.sq_entries;
+    r->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    r->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    r->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    r->to_submit = 0;
+
+    char *cq = r->cq_ring;
+    r->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    r->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    r->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+static void uring_teardown(struct uring *r) {
+    munmap(r->sqes, r->sqes_size);
+    munmap(r->sq_ring, r->sq_ring_size);
+    close(r->fd);
+}
+
+/**
+ * @return 0 if every opcode the engine relies on is supported.  Multishot
+ * accept has no probe bit of its own; it arrived in the same release as
+ * IORING_OP_SOCKET, which is probed in its place.
+ */
+static int uring_probe(struct uring *r) {
+    static const int required[] = {
+        IORING_OP_ACCEPT, IORING_OP_READ_FIXED, IORING_OP_WRITE,        IORING_OP_READ,
+        IORING_OP_SEND,   IORING_OP_POLL_ADD,   IORING_OP_ASYNC_CANCEL, IORING_OP_TIMEOUT,
+        IORING_OP_SOCKET,
+    };
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (probe == NULL) {
+        return -1;
+    }
+
+    int ret = sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST);
+    for (size_t i = 0; ret == 0 && i < sizeof(required) / sizeof(required[0]); i++) {
+        if (required[i] > probe->last_op || !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED)) {
+            ret = -1;
+        }
+    }
+    free(probe);
+    return ret;
+}
+
+static int uring_submit(struct uring *r, unsigned int wait_nr) {
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned int flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    int ret;
+    do {
+        ret = sys_io_uring_enter(r->fd, r->to_submit, wait_nr, flags);
+    } while (ret == -1 && errno == EINTR);
+    if (ret >= 0) {
+        r->to_submit = 0;
+    }
+    return ret;
+}
+
+/**
+ * @return how many of the @param wanted SQEs uring_get_sqe() can hand out
+ * in a row, submitting what is queued first if that makes room for more.
+ */
+static unsigned int uring_sq_space(struct uring *r, unsigned int wanted) {
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_entries - (r->sq_local_tail - head) < wanted && r->to_submit > 0) {
+        uring_submit(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    }
+    unsigned int space = r->sq_entries - (r->sq_local_tail - head);
+    return space < wanted ? space : wanted;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r) {
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        /* Submission queue full: push what we have to the kernel first */
+        uring_submit(r, 0);
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries) {
+            return NULL;
+        }
+    }
+
+    unsigned int index = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    r->sq_local_tail++;
+    r->to_submit++;
+    return sqe;
+}
+
+static void queue_multishot_accept(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = USER_DATA(OP_ACCEPT, 0);
+    accept_armed = 1;
+}
+
+static void cancel_accept(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = USER_DATA(OP_ACCEPT, 0);
+    sqe->user_data = USER_DATA(OP_CANCEL, 0);
+    accept_armed = 0;
+}
+
+static void queue_poll(int fd, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = USER_DATA(op, 0);
+}
+
+static void queue_recv(unsigned int slot) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->fd = slots[slot].conn.client_socket;
+    sqe->addr = (uint64_t)(uintptr_t)(recv_buffers + (size_t)slot * URING_RECV_BUF_SIZE);
+    sqe->len = URING_RECV_BUF_SIZE;
+    sqe->off = (uint64_t)-1;
+    sqe->buf_index = slot;
+    sqe->user_data = USER_DATA(OP_RECV, slot);
+}
+
+static int queue_read_back(unsigned int slot) {
+    struct uring_conn *uc = &slots[slot];
+    if (buffer_reserve(&uc->conn.out, URING_READ_CHUNK) == -1) {
+        return -1;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = FIXED_DATA_READ;
+    sqe->addr = (uint64_t)(uintptr_t)(uc->conn.out.data + uc->conn.out.len);
+    sqe->len = uc->conn.out.cap - uc->conn.out.len;
+    sqe->off = uc->read_offset;
+    sqe->user_data = USER_DATA(OP_READ, slot);
+    return 0;
+}
+
+static int queue_send(unsigned int slot) {
+    struct uring_conn *uc = &slots[slot];
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uc->conn.client_socket;
+    sqe->addr = (uint64_t)(uintptr_t)(uc->conn.out.data + uc->conn.out_sent);
+    sqe->len = uc->conn.out.len - uc->conn.out_sent;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = USER_DATA(OP_SEND, slot);
+    return 0;
+}
+
+static void assign_slot(int client_socket) {
+    unsigned int slot = free_head;
+    struct uring_conn *uc = &slots[slot];
+    free_head = uc->next_free;
+    memset(uc, 0, sizeof(*uc));
+    uc->in_use = 1;
+    uc->conn.client_socket = client_socket;
+    uc->conn.pass_fd = -1;
+    active_conns++;
+    metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+    queue_recv(slot);
+}
+
+static void close_conn(unsigned int slot) {
+    struct uring_conn *uc = &slots[slot];
+    close(uc->conn.client_socket);
+    free(uc->conn.in.data);
+    free(uc->conn.out.data);
+    memset(&uc->conn, 0, sizeof(uc->conn));
+    uc->in_use = 0;
+    uc->next_free = free_head;
+    free_head = slot;
+    active_conns--;
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+
+    if (overflow_count > 0) {
+        overflow_count--;
+        assign_slot(overflow_fds[overflow_head]);
+        overflow_head = (overflow_head + 1) % URING_OVERFLOW;
+    } else if (!accept_armed && atomic_load(&server_running)) {
+        queue_multishot_accept();
+    }
+}
+
+static void start_read_back(unsigned int slot) {
+    slots[slot].read_offset = 0;
+    slots[slot].read_started = metrics_now_ns();
+    if (queue_read_back(slot) == -1) {
+        close_conn(slot);
+    }
+}
+
+/**
+ * Commit the complete lines received so far on @param slot as one linked
+ * chain of appends, one write per line so the device keeps one entry per
+ * command.  The chain's SQEs are reserved up front, so it never ends on a
+ * linked SQE that would chain it to an unrelated request; lines beyond what
+ * the submission queue holds wait for the next batch.
+ * @return 1 if a batch was started, 0 if no complete line is buffered yet.
+ */
+static int start_batch(unsigned int slot) {
+    struct uring_conn *uc = &slots[slot];
+    struct connection *conn = &uc->conn;
+
+    /* Binary frames are cheap to split, so they are handled synchronously */
+    negotiate_protocol(conn);
+    if (conn->protocol == PROTOCOL_BINARY) {
+        if (process_frames(conn) == -1) {
+            close_conn(slot);
+            return 1;
+        }
+        if (conn->out.len == 0) {
+            return 0;
+        }
+        if (queue_send(slot) == -1) {
+            close_conn(slot);
+        }
+        return 1;
+    }
+
+    char *newline = memrchr(conn->in.data, '\n', conn->in.len);
+    if (newline == NULL) {
+        return 0;
+    }
+
+    uc->batch_len = newline - conn->in.data + 1;
+    uc->bytes_written = 0;
+    uc->write_failed = 0;
+
+    size_t start = 0;
+    int has_command = 0;
+    while (start < uc->batch_len) {
+        if (strncmp(conn->in.data + start, "AESDCHAR_IOCSEEKTO:",
+                    strlen("AESDCHAR_IOCSEEKTO:")) == 0 ||
+            strncmp(conn->in.data + start, "AESDCHAR_IOCFILTER:",
+                    strlen("AESDCHAR_IOCFILTER:")) == 0) {
+            has_command = 1;
+            break;
+        }
+        start = (char *)memchr(conn->in.data + start, '\n', uc->batch_len - start) -
+                conn->in.data + 1;
+    }
+    /* A follower writes nothing; process_lines() refuses its lines */
+    if (has_command || primary_addr != NULL) {
+        if (process_lines(conn) == -1 || queue_send(slot) == -1) {
+            close_conn(slot);
+        }
+        return 1;
+    }
+
+    unsigned int lines = 0;
+    for (start = 0; start < uc->batch_len; lines++) {
+        start = (char *)memchr(conn->in.data + start, '\n', uc->batch_len - start) -
+                conn->in.data + 1;
+    }
+    unsigned int chain = uring_sq_space(&ring, lines);
+    if (chain == 0) {
+        close_conn(slot);
+        return 1;
+    }
+
+    start = 0;
+    for (unsigned int i = 0; i < chain; i++) {
+        size_t line_len = (char *)memchr(conn->in.data + start, '\n', uc->batch_len - start) -
+                          (conn->in.data + start) + 1;
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = FIXED_DATA_WRITE;
+        sqe->addr = (uint64_t)(uintptr_t)(conn->in.data + start);
+        sqe->len = line_len;
+        sqe->off = (uint64_t)-1;
+        sqe->user_data = USER_DATA(OP_WRITE, slot);
+        start += line_len;
+        if (i + 1 < chain) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        uc->writes_pending++;
+    }
+    uc->batch_len = start;
+    metrics_add(METRIC_RECORDS, uc->writes_pending);
+    return 1;
+}
+
+static void handle_accept(const struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        accept_armed = 0;
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            syslog(LOG_WARNING, "uring accept: %s", strerror(-cqe->res));
+        }
+        if (!accept_armed && atomic_load(&server_running) && free_head != UINT32_MAX) {
+            queue_multishot_accept();
+        }
+        return;
+    }
+
+    int client_socket = cqe->res;
+    if (!atomic_load(&server_running)) {
+        close(client_socket);
+        return;
+    }
+    if (free_head == UINT32_MAX) {
+        if (overflow_count == URING_OVERFLOW) {
+            close(client_socket);
+        } else {
+            overflow_fds[(overflow_head + overflow_count++) % URING_OVERFLOW] = client_socket;
+        }
+        return;
+    }
+
+    assign_slot(client_socket);
+    if (free_head == UINT32_MAX && accept_armed) {
+        /* Out of slots: further clients wait in the kernel backlog */
+        cancel_accept();
+    }
+}
+
+static void handle_recv(unsigned int slot, int res) {
+    struct uring_conn *uc = &slots[slot];
+    struct connection *conn = &uc->conn;
+
+    if (res == -EINTR || res == -EAGAIN) {
+        queue_recv(slot);
+        return;
+    }
+    if (res <= 0) {
+        close_conn(slot);
+        return;
+    }
+
+    if (buffer_reserve(&conn->in, res) == -1) {
+        close_conn(slot);
+        return;
+    }
+    memcpy(conn->in.data + conn->in.len, recv_buffers + (size_t)slot * URING_RECV_BUF_SIZE, res);
+    conn->in.len += res;
+    metrics_add(METRIC_BYTES_IN, res);
+    AESD_PROBE2(recv, conn->client_socket, res);
+
+    if (uc->received_at == 0) {
+        uc->received_at = metrics_now_ns();
+    }
+    if (!start_batch(slot)) {
+        uc->received_at = 0;
+        queue_recv(slot);
+    }
+}
+
+static void handle_write(unsigned int slot, int res) {
+    struct uring_conn *uc = &slots[slot];
+    if (res < 0) {
+        if (res != -ECANCELED) {
+            syslog(LOG_ERR, "uring write: %s", strerror(-res));
+        }
+        uc->write_failed = 1;
+    } else {
+        uc->bytes_written += res;
+    }
+    if (--uc->writes_pending > 0) {
+        return;
+    }
+    if (!uc->write_failed && uc->bytes_written != uc->batch_len) {
+        syslog(LOG_ERR, "uring write: short append, %zu of %zu bytes", uc->bytes_written,
+               uc->batch_len);
+        uc->write_failed = 1;
+    }
+
+    /* The appends landed without data_mutex, so a primary on the ring has no subscribers */
+    struct connection *conn = &uc->conn;
+    memmove(conn->in.data, conn->in.data + uc->batch_len, conn->in.len - uc->batch_len);
+    conn->in.len -= uc->batch_len;
+    uc->batch_len = 0;
+
+    if (uc->write_failed) {
+        close_conn(slot);
+        return;
+    }
+    start_read_back(slot);
+}
+
+static void handle_read(unsigned int slot, int res) {
+    struct uring_conn *uc = &slots[slot];
+    if (res < 0) {
+        syslog(LOG_ERR, "uring read: %s", strerror(-res));
+        close_conn(slot);
+        return;
+    }
+    if (res > 0) {
+        uc->conn.out.len += res;
+        uc->read_offset += res;
+        if (queue_read_back(slot) == -1) {
+            close_conn(slot);
+        }
+        return;
+    }
+    metrics_observe(METRIC_READ_BACK, metrics_now_ns() - uc->read_started);
+    if (uc->conn.out.len == 0) {
+        if (!start_batch(slot)) {
+            queue_recv(slot);
+        }
+    } else if (queue_send(slot) == -1) {
+        close_conn(slot);
+    }
+}
+
+static void handle_send(unsigned int slot, int res) {
+    struct uring_conn *uc = &slots[slot];
+    struct connection *conn = &uc->conn;
+    if (res < 0 && res != -EINTR && res != -EAGAIN) {
+        close_conn(slot);
+        return;
+    }
+    if (res > 0) {
+        conn->out_sent += res;
+        metrics_add(METRIC_BYTES_OUT, res);
+        AESD_PROBE2(send, conn->client_socket, res);
+    }
+    if (conn->out_sent < conn->out.len) {
+        if (queue_send(slot) == -1) {
+            close_conn(slot);
+        }
+        return;
+    }
+
+    conn->out.len = 0;
+    conn->out_sent = 0;
+    if (uc->received_at != 0) {
+        metrics_observe(METRIC_RECV_TO_ACK, metrics_now_ns() - uc->received_at);
+        uc->received_at = 0;
+    }
+    if (!start_batch(slot)) {
+        queue_recv(slot);
+    }
+}
+
+/**
+ * Stop accepting, half-close every client so queued records are still
+ * committed, and arm a timeout which cuts off whoever is left at the
+ * shutdown deadline.
+ */
+static void begin_shutdown(void) {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) > 0) {
+    }
+
+    atomic_store(&server_running, 0);
+    if (accept_armed) {
+        cancel_accept();
+    }
+    for (unsigned int i = 0; i < num_slots; i++) {
+        if (slots[i].in_use) {
+            shutdown(slots[i].conn.client_socket, SHUT_RD);
+        }
+    }
+    for (unsigned int i = 0; i < overflow_count; i++) {
+        shutdown(overflow_fds[(overflow_head + i) % URING_OVERFLOW], SHUT_RD);
+    }
+
+    static struct __kernel_timespec deadline;
+    deadline.tv_sec = shutdown_deadline_ms / 1000;
+    deadline.tv_nsec = (long long)(shutdown_deadline_ms % 1000) * 1000000LL;
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (uint64_t)(uintptr_t)&deadline;
+        sqe->len = 1;
+        sqe->user_data = USER_DATA(OP_DEADLINE, 0);
+    }
+}
+
+static void handle_deadline(void) {
+    if (active_conns == 0) {
+        return;
+    }
+    syslog(LOG_WARNING, "Shutdown deadline expired with %u connections open", active_conns);
+    for (unsigned int i = 0; i < num_slots; i++) {
+        if (slots[i].in_use) {
+            shutdown(slots[i].conn.client_socket, SHUT_RDWR);
+        }
+    }
+}
+
+static void dispatch(const struct io_uring_cqe *cqe) {
+    unsigned int slot = USER_DATA_SLOT(cqe->user_data);
+
+    switch (USER_DATA_OP(cqe->user_data)) {
+        case OP_ACCEPT:
+            handle_accept(cqe);
+            break;
+        case OP_RECV:
+            handle_recv(slot, cqe->res);
+            break;
+        case OP_WRITE:
+            handle_write(slot, cqe->res);
+            break;
+        case OP_READ:
+            handle_read(slot, cqe->res);
+            break;
+        case OP_SEND:
+            handle_send(slot, cqe->res);
+            break;
+        case OP_TIMER:
+            run_periodic_tasks();
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                queue_poll(timer_fd, OP_TIMER);
+            }
+            break;
+        case OP_SIGNAL:
+            if (atomic_load(&server_running)) {
+                begin_shutdown();
+            }
+            break;
+        case OP_DEADLINE:
+            handle_deadline();
+            break;
+        case OP_METRICS:
+            metrics_serve(metrics_fd);
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                queue_poll(metrics_fd, OP_METRICS);
+            }
+            break;
+        case OP_CANCEL:
+            break;
+    }
+}
+
+static int register_resources(void) {
+    num_slots = max_connections != 0 && max_connections < URING_MAX_SLOTS ? max_connections
+                                                                          : URING_MAX_SLOTS;
+    slots = calloc(num_slots, sizeof(struct uring_conn));
+    overflow_fds = calloc(URING_OVERFLOW, sizeof(int));
+    recv_buffers = mmap(NULL, (size_t)num_slots * URING_RECV_BUF_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct iovec *iovecs = calloc(num_slots, sizeof(struct iovec));
+    if (slots == NULL || overflow_fds == NULL || recv_buffers == MAP_FAILED || iovecs == NULL) {
+        free(iovecs);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < num_slots; i++) {
+        iovecs[i].iov_base = recv_buffers + (size_t)i * URING_RECV_BUF_SIZE;
+        iovecs[i].iov_len = URING_RECV_BUF_SIZE;
+        slots[i].next_free = i + 1 < num_slots ? i + 1 : UINT32_MAX;
+    }
+    free_head = 0;
+
+    int ret = sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, iovecs, num_slots);
+    free(iovecs);
+    if (ret == -1) {
+        return -1;
+    }
+
+    data_read_fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (data_read_fd == -1) {
+        return -1;
+    }
+    int files[] = { data_fd, data_read_fd };
+    return sys_io_uring_register(ring.fd, IORING_REGISTER_FILES, files, 2);
+}
+
+static void release_resources(void) {
+    if (slots != NULL) {
+        for (unsigned int i = 0; i < num_slots; i++) {
+            if (slots[i].in_use) {
+                close(slots[i].conn.client_socket);
+                free(slots[i].conn.in.data);
+                free(slots[i].conn.out.data);
+            }
+        }
+    }
+    free(slots);
+    slots = NULL;
+    while (overflow_count > 0) {
+        overflow_count--;
+        close(overflow_fds[overflow_head]);
+        overflow_head = (overflow_head + 1) % URING_OVERFLOW;
+    }
+    free(overflow_fds);
+    overflow_fds = NULL;
+    if (recv_buffers != NULL && recv_buffers != MAP_FAILED) {
+        munmap(recv_buffers, (size_t)num_slots * URING_RECV_BUF_SIZE);
+    }
+    recv_buffers = NULL;
+    if (data_read_fd != -1) {
+        close(data_read_fd);
+        data_read_fd = -1;
+    }
+}
+
+/**
+ * Serve clients on acceptors[0].listen_fd until SIGINT/SIGTERM arrives and
+ * the connections have drained.
+ * @return 0 once the engine ran to completion, or -1 if io_uring isn't usable
+ * here, in which case nothing was accepted and the caller should fall back.
+ */
+int uring_engine_run(void) {
+    if (uring_setup(&ring, URING_ENTRIES) == -1) {
+        syslog(LOG_WARNING, "io_uring unavailable: %s", strerror(errno));
+        return -1;
+    }
+    if (uring_probe(&ring) == -1 || register_resources() == -1) {
+        syslog(LOG_WARNING, "io_uring lacks required features, using epoll engine");
+        release_resources();
+        uring_teardown(&ring);
+        return -1;
+    }
+
+    listen_fd = acceptors[0].listen_fd;
+    queue_multishot_accept();
+    queue_poll(signal_fd, OP_SIGNAL);
+    if (timer_fd != -1) {
+        queue_poll(timer_fd, OP_TIMER);
+    }
+    if (metrics_fd != -1) {
+        queue_poll(metrics_fd, OP_METRICS);
+    }
+
+    while (atomic_load(&server_running) || active_conns > 0) {
+        if (uring_submit(&ring, 1) == -1) {
+            perror("io_uring_enter");
+            break;
+        }
+
+        unsigned int head = *ring.cq_head;
+        unsigned int tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            dispatch(&cqe);
+        }
+    }
+
+    release_resources();
+    uring_teardown(&ring);
+    return 0;
+}
@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -7,178 +9,1292 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <pthread.h>
 #include <time.h>
 #include <sys/stat.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include "aesdsocket.h"
+#include "aesdsocket-metrics.h"
+#include "aesdsocket-trace.h"
+#include "aesd-shm-ring.h"
+#include "../examples/threading/threadpool.h"
 
-#define PORT 9000
-#define USE_AESD_CHAR_DEVICE
+pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-#ifdef USE_AESD_CHAR_DEVICE
-#define DATA_FILE "/dev/aesdchar"
-#else
-#define DATA_FILE "/var/tmp/aesdsocketdata"
-#endif
+pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Set up in main() to time drain_connections() against CLOCK_MONOTONIC */
+pthread_cond_t conn_cond;
+struct connection *conn_list = NULL;
+unsigned int live_connections = 0;
 
-typedef struct thread_node {
-    pthread_t tid;
-    struct thread_node *next;
-} ThreadNode;
+unsigned int shutdown_deadline_ms = DEFAULT_SHUTDOWN_DEADLINE_MS;
+int listen_backlog = DEFAULT_LISTEN_BACKLOG;
+unsigned int max_connections = DEFAULT_MAX_CONNECTIONS;
+size_t output_buffer_limit = DEFAULT_OUTPUT_BUFFER_LIMIT;
+/* Answer each run of pipelined lines with one response instead of one per line */
+int coalesce_responses = 0;
 
-int server_fd;
-pthread_mutex_t data_mutex = PTHREAD_MUTEX_INITIALIZER;
-ThreadNode *thread_list = NULL;
+int data_fd = -1;
+int signal_fd = -1;
+int metrics_fd = -1;
+atomic_int server_running = 1;
+
+struct acceptor *acceptors = NULL;
+unsigned int num_acceptors = 1;
+unsigned int listen_port = PORT;
+
+const char *data_path = DATA_FILE;
+const char *primary_addr = NULL;
+/* With -e uring, once the ring is up; cleared if it falls back to epoll */
+atomic_int use_uring = 0;
+
+/* With -u, local clients can also connect on this Unix socket, through one more acceptor */
+const char *unix_path = NULL;
+/* The TCP acceptors plus the Unix socket acceptor, if any */
+unsigned int total_acceptors = 1;
+
+/* With -w, connections are served by this many pooled workers instead of a thread each */
+unsigned int pool_workers = 0;
+struct threadpool *connection_pool = NULL;
+
+/* With -s, records also arrive from local producers through this shared-memory ring */
+const char *shm_ring_name = NULL;
+struct shm_ring shm_ring;
+pthread_t shm_ring_tid;
+
+#define SHM_RING_CAPACITY (1024 * 1024)
+#define SHM_RING_BATCH 64
+/* How often an idle ring consumer checks for shutdown */
+#define SHM_RING_WAIT_MS 100
+
+void wake_acceptors(void);
+
+/* Last id handed out by trace_next_record_id(), across every thread */
+static atomic_uint_fast64_t last_record_id;
+
+uint64_t trace_next_record_id(void) {
+    return atomic_fetch_add_explicit(&last_record_id, 1, memory_order_relaxed) + 1;
+}
 
 #ifndef USE_AESD_CHAR_DEVICE
-void *append_timestamp(void *arg) {
-    while (1) {
-        time_t current_time = time(NULL);
-        struct tm *time_info = localtime(&current_time);
+#define TIMESTAMP_PERIOD_S 10
 
-        char timestamp[100];
-        strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %H:%M:%S %z", time_info);
-        strcat(timestamp, "\n");
+/*
+ * Cached rendering of the timestamp record.  Only the time of day changes
+ * between consecutive records, so the "timestamp:%a, %d %b %Y " prefix and the
+ * " %z" suffix are rendered with strftime() once per day (or on a UTC offset
+ * change) and the %H:%M:%S digits are patched in place for every record.
+ */
+struct timestamp_cache {
+    int year;
+    int yday;
+    long gmtoff;
+    size_t prefix_len;
+    size_t record_len;
+    char record[128];
+};
 
-        pthread_mutex_lock(&data_mutex);
+static struct timestamp_cache ts_cache = { .year = -1 };
+
+static void put_two_digits(char *dst, int value) {
+    dst[0] = '0' + value / 10;
+    dst[1] = '0' + value % 10;
+}
+
+static size_t render_timestamp(time_t now) {
+    struct tm time_info;
+    localtime_r(&now, &time_info);
+
+    if (time_info.tm_year != ts_cache.year || time_info.tm_yday != ts_cache.yday ||
+        time_info.tm_gmtoff != ts_cache.gmtoff) {
+        char suffix[32];
+        ts_cache.prefix_len = strftime(ts_cache.record, sizeof(ts_cache.record),
+                                       "timestamp:%a, %d %b %Y ", &time_info);
+        size_t suffix_len = strftime(suffix, sizeof(suffix), " %z\n", &time_info);
+        memcpy(ts_cache.record + ts_cache.prefix_len + 8, suffix, suffix_len);
+        ts_cache.record[ts_cache.prefix_len + 2] = ':';
+        ts_cache.record[ts_cache.prefix_len + 5] = ':';
+        ts_cache.record_len = ts_cache.prefix_len + 8 + suffix_len;
+        ts_cache.year = time_info.tm_year;
+        ts_cache.yday = time_info.tm_yday;
+        ts_cache.gmtoff = time_info.tm_gmtoff;
+    }
+
+    char *clock = ts_cache.record + ts_cache.prefix_len;
+    put_two_digits(clock, time_info.tm_hour);
+    put_two_digits(clock + 3, time_info.tm_min);
+    put_two_digits(clock + 6, time_info.tm_sec);
+    return ts_cache.record_len;
+}
+
+void append_timestamp(void) {
+    size_t len = render_timestamp(time(NULL));
+
+    pthread_mutex_lock(&data_mutex);
+    if (write(data_fd, ts_cache.record, len) != (ssize_t)len) {
+        perror("write timestamp");
+        replicate_failed();
+    } else {
+        struct iovec iov = { .iov_base = ts_cache.record, .iov_len = len };
+        replicate(&iov, 1);
+    }
+    pthread_mutex_unlock(&data_mutex);
+}
+#endif
+
+/*
+ * Periodic work is driven from the main event loop by a single timerfd which
+ * is always armed for the earliest due task, rather than by sleeping threads.
+ */
+struct periodic_task {
+    unsigned int period_s;
+    struct timespec next_due;
+    void (*run)(void);
+};
+
+struct periodic_task periodic_tasks[] = {
+#ifndef USE_AESD_CHAR_DEVICE
+    { .period_s = TIMESTAMP_PERIOD_S, .run = append_timestamp },
+#endif
+};
+
+#define NUM_PERIODIC_TASKS ((int)(sizeof(periodic_tasks) / sizeof(periodic_tasks[0])))
+
+int timer_fd = -1;
+
+static int timespec_before(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void arm_timer(void) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+
+    for (int i = 0; i < NUM_PERIODIC_TASKS; i++) {
+        if (i == 0 || timespec_before(&periodic_tasks[i].next_due, &its.it_value)) {
+            its.it_value = periodic_tasks[i].next_due;
+        }
+    }
 
-        FILE *fp = fopen(DATA_FILE, "a");
-        if (fp == NULL) {
-            perror("fopen");
-            pthread_mutex_unlock(&data_mutex);
-            sleep(10);
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror("timerfd_settime");
+    }
+}
+
+int start_periodic_tasks(void) {
+    if (NUM_PERIODIC_TASKS == 0) {
+        return 0;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        perror("timerfd_create");
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < NUM_PERIODIC_TASKS; i++) {
+        periodic_tasks[i].next_due = now;
+        periodic_tasks[i].next_due.tv_sec += periodic_tasks[i].period_s;
+    }
+    arm_timer();
+    return 0;
+}
+
+void run_periodic_tasks(void) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < NUM_PERIODIC_TASKS; i++) {
+        struct periodic_task *task = &periodic_tasks[i];
+        if (timespec_before(&now, &task->next_due)) {
             continue;
         }
+        task->run();
+        /* Keep the cadence fixed; skip slots missed while the loop was busy */
+        while (!timespec_before(&now, &task->next_due)) {
+            task->next_due.tv_sec += task->period_s;
+        }
+    }
+    arm_timer();
+}
+
+void connection_register(struct connection *conn) {
+    pthread_mutex_lock(&conn_mutex);
+    conn->prev = NULL;
+    conn->next = conn_list;
+    if (conn_list != NULL) {
+        conn_list->prev = conn;
+    }
+    conn_list = conn;
+    live_connections++;
+    pthread_mutex_unlock(&conn_mutex);
+}
+
+void connection_unregister(struct connection *conn) {
+    pthread_mutex_lock(&conn_mutex);
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    } else {
+        conn_list = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    live_connections--;
+    if (max_connections != 0 && live_connections == max_connections - 1) {
+        wake_acceptors();
+    }
+    pthread_cond_signal(&conn_cond);
+    pthread_mutex_unlock(&conn_mutex);
+}
+
+/**
+ * Stop reading from every live client and wait up to shutdown_deadline_ms for
+ * the handlers to finish the records they already received.  Data queued in
+ * the socket before SHUT_RD is still delivered to recv(), so complete lines
+ * in flight are committed and answered.  Clients still connected at the
+ * deadline are cut off entirely.
+ */
+void drain_connections(void) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += shutdown_deadline_ms / 1000;
+    deadline.tv_nsec += (long)(shutdown_deadline_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+    for (struct connection *conn = conn_list; conn != NULL; conn = conn->next) {
+        shutdown(conn->client_socket, SHUT_RD);
+    }
+
+    while (live_connections > 0) {
+        if (pthread_cond_timedwait(&conn_cond, &conn_mutex, &deadline) == ETIMEDOUT) {
+            syslog(LOG_WARNING, "Shutdown deadline expired with %u connections open",
+                   live_connections);
+            for (struct connection *conn = conn_list; conn != NULL; conn = conn->next) {
+                shutdown(conn->client_socket, SHUT_RDWR);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&conn_mutex);
+}
+
+/**
+ * Make room for at least @param extra more bytes at the end of @param buf.
+ * @return 0 on success, -1 if the buffer could not be grown.
+ */
+int buffer_reserve(struct io_buffer *buf, size_t extra) {
+    if (buf->len + extra <= buf->cap) {
+        return 0;
+    }
+    size_t new_cap = buf->cap ? buf->cap : 1024;
+    while (new_cap < buf->len + extra) {
+        new_cap *= 2;
+    }
+    char *new_data = realloc(buf->data, new_cap);
+    if (new_data == NULL) {
+        return -1;
+    }
+    buf->data = new_data;
+    buf->cap = new_cap;
+    return 0;
+}
+
+/**
+ * Append what is left to read of @param fd to the output buffer of
+ * @param conn; on error, take back whatever was appended.
+ * @return 0 on success, -1 on error.
+ */
+static int read_rest(struct connection *conn, int fd) {
+    size_t out_len = conn->out.len;
+    ssize_t bytes_read;
+    do {
+        if (buffer_reserve(&conn->out, 1024) == -1) {
+            bytes_read = -1;
+            break;
+        }
+        bytes_read = read(fd, conn->out.data + conn->out.len, conn->out.cap - conn->out.len);
+        if (bytes_read > 0) {
+            conn->out.len += bytes_read;
+        }
+    } while (bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
+
+    if (bytes_read != 0) {
+        conn->out.len = out_len;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Append the full contents of data_path to the output buffer of @param conn.
+ * Called with data_mutex held; the bytes are sent once the lock is dropped
+ * so a slow reader never stalls other connections.
+ */
+int read_aesdchar_content(struct connection *conn) {
+    int fd = open(data_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    int ret = read_rest(conn, fd);
+    close(fd);
+    return ret;
+}
+
+int read_content_from(struct connection *conn, uint32_t write_cmd, uint32_t write_cmd_offset) {
+    int fd = open(data_path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    struct aesd_seekto seek_data;
+    seek_data.write_cmd = write_cmd;
+    seek_data.write_cmd_offset = write_cmd_offset;
+
+    int ret = ioctl(fd, AESDCHAR_IOCSEEKTO, &seek_data);
+    if (ret == -1) {
+        perror("ioctl AESDCHAR_IOCSEEKTO");
+        ret = 1;
+    } else {
+        ret = read_rest(conn, fd);
+    }
+    close(fd);
+    return ret;
+}
+
+/**
+ * Answer "AESDCHAR_IOCSEEKTO:<write_cmd>,<write_cmd_offset>", the command at
+ * @param command, with the history from that position.  A malformed
+ * command, or a position the device refuses, is answered with all of it.
+ * Called with data_mutex held.
+ */
+static int handle_seek_command(struct connection *conn, const char *command) {
+    unsigned int x, y;
+    if (sscanf(command, "AESDCHAR_IOCSEEKTO:%u,%u", &x, &y) == 2) {
+        int ret = read_content_from(conn, x, y);
+        if (ret != 1) {
+            return ret;
+        }
+    }
+    return read_aesdchar_content(conn);
+}
 
-        fputs(timestamp, fp);
-        fclose(fp);
+#define FILTER_COMMAND "AESDCHAR_IOCFILTER:"
 
+static int is_filter_command(const char *line) {
+    return strncmp(line, FILTER_COMMAND, strlen(FILTER_COMMAND)) == 0;
+}
+
+#define FOLLOWER_WRITE_ERROR "ERROR: read-only follower, write to the primary\n"
+
+/**
+ * Answer a line a follower won't write with FOLLOWER_WRITE_ERROR in place
+ * of the read-back, so the client can't mistake it for a commit.
+ */
+static int refuse_follower_write(struct connection *conn) {
+    size_t len = strlen(FOLLOWER_WRITE_ERROR);
+    if (buffer_reserve(&conn->out, len) == -1) {
+        return -1;
+    }
+    memcpy(conn->out.data + conn->out.len, FOLLOWER_WRITE_ERROR, len);
+    conn->out.len += len;
+    return 0;
+}
+
+/**
+ * Answer "AESDCHAR_IOCFILTER:substr,<pattern>" or
+ * "AESDCHAR_IOCFILTER:prefix,<pattern>", the @param len bytes at
+ * @param command without the newline, with only the entries containing or
+ * starting with the pattern.  Anything else after the colon is answered
+ * with the whole history, as a malformed seek command is.
+ * Called with data_mutex held.
+ */
+static int handle_filter_command(struct connection *conn, const char *command, size_t len) {
+    const char *mode = command + strlen(FILTER_COMMAND);
+    const char *end = command + len;
+    const char *comma = memchr(mode, ',', end - mode);
+
+    if (comma != NULL && comma - mode == 6) {
+        if (memcmp(mode, "substr", 6) == 0) {
+            return read_filtered_content(conn, AESD_FILTER_SUBSTRING, comma + 1, end - comma - 1);
+        }
+        if (memcmp(mode, "prefix", 6) == 0) {
+            return read_filtered_content(conn, AESD_FILTER_PREFIX, comma + 1, end - comma - 1);
+        }
+    }
+    return read_aesdchar_content(conn);
+}
+
+/**
+ * Consumer thread for the shared-memory ring: commits every published record
+ * as one write of DATA_FILE, SHM_RING_BATCH records per writev() and per
+ * data_mutex acquisition, until shutdown and the ring are both done.
+ * Records are taken as they are, so producers end them with '\n' just as
+ * socket clients end their lines.
+ */
+static void *shm_ring_consumer(void *arg) {
+    (void)arg;
+    struct iovec iov[SHM_RING_BATCH];
+
+    for (;;) {
+        uint64_t consumed;
+        int count = shm_ring_peek(&shm_ring, iov, SHM_RING_BATCH, &consumed);
+        if (count == -1) {
+            syslog(LOG_ERR, "Shared memory ring %s is corrupt, no longer reading it", shm_ring_name);
+            break;
+        }
+        if (count == 0 && consumed == 0) {
+            if (!atomic_load(&server_running)) {
+                break;
+            }
+            shm_ring_wait(&shm_ring, SHM_RING_WAIT_MS);
+            continue;
+        }
+
+        size_t bytes = 0;
+        for (int i = 0; i < count; i++) {
+            bytes += iov[i].iov_len;
+        }
+        uint64_t wait_start = metrics_now_ns();
+        pthread_mutex_lock(&data_mutex);
+        metrics_observe(METRIC_LOCK_WAIT, metrics_now_ns() - wait_start);
+        if (count > 0 && writev(data_fd, iov, count) != (ssize_t)bytes) {
+            perror("writev");
+            replicate_failed();
+        } else {
+            replicate(iov, count);
+        }
         pthread_mutex_unlock(&data_mutex);
+        shm_ring_consume(&shm_ring, consumed);
+        metrics_add(METRIC_RECORDS, count);
+        metrics_add(METRIC_BYTES_IN, bytes);
+    }
+    return NULL;
+}
+
+#define LINE_BATCH_IOV 64
 
-        sleep(10);
+static void write_line_batch(struct iovec *iov, int *iovcnt, size_t *bytes) {
+    if (*iovcnt == 0) {
+        return;
     }
+    if (writev(data_fd, iov, *iovcnt) != (ssize_t)*bytes) {
+        perror("writev");
+        replicate_failed();
+    } else {
+        replicate(iov, *iovcnt);
+    }
+    *iovcnt = 0;
+    *bytes = 0;
 }
-#endif
 
-void signal_handler(int sig) {
-    if (sig == SIGINT || sig == SIGTERM) {
-        syslog(LOG_INFO, "Caught signal, exiting");
+/**
+ * Coalescing variant of process_lines(): every complete line in the input
+ * buffer is committed under one data_mutex acquisition, with one writev()
+ * per LINE_BATCH_IOV lines (one device entry per line is preserved), and the
+ * run is answered by a single read-back reflecting the state after it.  A
+ * seek command ends its run, so the read position it selects still applies
+ * to the response; so does a filter command, whose matches are then the
+ * response.
+ */
+static int process_line_batches(struct connection *conn) {
+    size_t start = 0;
+
+    while (memchr(conn->in.data + start, '\n', conn->in.len - start) != NULL) {
+        struct iovec iov[LINE_BATCH_IOV];
+        int iovcnt = 0;
+        size_t bytes = 0;
+        char *newline;
+        const char *filter = NULL;
+        size_t filter_len = 0;
+        const char *seek = NULL;
 
+        uint64_t wait_start = metrics_now_ns();
         pthread_mutex_lock(&data_mutex);
+        metrics_observe(METRIC_LOCK_WAIT, metrics_now_ns() - wait_start);
+        while ((newline = memchr(conn->in.data + start, '\n', conn->in.len - start)) != NULL) {
+            char *line = conn->in.data + start;
+            size_t line_len = newline - line + 1;
+            start += line_len;
+            metrics_add(METRIC_RECORDS, 1);
 
-        ThreadNode *current = thread_list;
-        while (current != NULL) {
-            pthread_cancel(current->tid);
-            pthread_join(current->tid, NULL);
-            ThreadNode *temp = current;
-            current = current->next;
-            free(temp);
+            if (strncmp(line, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0) {
+                write_line_batch(iov, &iovcnt, &bytes);
+                *newline = '\0';
+                seek = line;
+                break;
+            }
+            if (is_filter_command(line)) {
+                filter = line;
+                filter_len = line_len - 1;
+                break;
+            }
+            iov[iovcnt].iov_base = line;
+            iov[iovcnt].iov_len = line_len;
+            iovcnt++;
+            bytes += line_len;
+            if (iovcnt == LINE_BATCH_IOV) {
+                write_line_batch(iov, &iovcnt, &bytes);
+            }
         }
-        thread_list = NULL;
+        write_line_batch(iov, &iovcnt, &bytes);
 
+        uint64_t read_start = metrics_now_ns();
+        int ret;
+        if (seek != NULL) {
+            ret = handle_seek_command(conn, seek);
+        } else if (filter != NULL) {
+            ret = handle_filter_command(conn, filter, filter_len);
+        } else {
+            ret = read_aesdchar_content(conn);
+        }
         pthread_mutex_unlock(&data_mutex);
+        metrics_observe(METRIC_READ_BACK, metrics_now_ns() - read_start);
+        if (ret == -1) {
+            return -1;
+        }
+    }
 
-        close(server_fd);
-#ifndef USE_AESD_CHAR_DEVICE
-        remove(DATA_FILE);
-#endif
-        exit(EXIT_SUCCESS);
+    memmove(conn->in.data, conn->in.data + start, conn->in.len - start);
+    conn->in.len -= start;
+    return 0;
+}
+
+/**
+ * Commit every complete line received so far and queue the responses.
+ * A trailing partial line stays in the input buffer until its newline arrives.
+ * A follower commits nothing: commands are answered as usual, and every
+ * other line with FOLLOWER_WRITE_ERROR, one by one even with -r batch.
+ */
+int process_lines(struct connection *conn) {
+    size_t start = 0;
+    char *newline;
+
+    if (coalesce_responses && primary_addr == NULL) {
+        return process_line_batches(conn);
+    }
+
+    while ((newline = memchr(conn->in.data + start, '\n', conn->in.len - start)) != NULL) {
+        char *line = conn->in.data + start;
+        size_t line_len = newline - line + 1;
+        uint64_t id = trace_next_record_id();
+        size_t out_len = conn->out.len;
+        ssize_t written;
+        int seek = 0;
+        int refused = 0;
+        int ret = 0;
+
+        AESD_PROBE3(record_start, id, conn->client_socket, line_len);
+        uint64_t wait_start = metrics_now_ns();
+        pthread_mutex_lock(&data_mutex);
+        uint64_t locked = metrics_now_ns();
+        metrics_observe(METRIC_LOCK_WAIT, locked - wait_start);
+        AESD_PROBE1(record_locked, id);
+        if (strncmp(line, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0) {
+            /* Only moves the descriptor the read-back below uses */
+            *newline = '\0';
+            written = 0;
+            seek = 1;
+        } else if (is_filter_command(line)) {
+            /* Only a query: nothing is written */
+            written = 0;
+        } else if (primary_addr != NULL) {
+            written = 0;
+            refused = 1;
+        } else if ((written = write(data_fd, line, line_len)) != (ssize_t)line_len) {
+            perror("write");
+            replicate_failed();
+        } else {
+            struct iovec iov = { .iov_base = line, .iov_len = line_len };
+            replicate(&iov, 1);
+        }
+        AESD_PROBE2(record_written, id, written);
+        uint64_t read_start = metrics_now_ns();
+        if (refused) {
+            ret = refuse_follower_write(conn);
+        } else if (seek) {
+            ret = handle_seek_command(conn, line);
+        } else if (is_filter_command(line)) {
+            ret = handle_filter_command(conn, line, line_len - 1);
+        } else {
+            ret = read_aesdchar_content(conn);
+        }
+        AESD_PROBE2(record_read_back, id, conn->out.len - out_len);
+        pthread_mutex_unlock(&data_mutex);
+        metrics_observe(METRIC_READ_BACK, metrics_now_ns() - read_start);
+        metrics_add(METRIC_RECORDS, 1);
+
+        if (ret == -1) {
+            return -1;
+        }
+        start += line_len;
     }
+
+    memmove(conn->in.data, conn->in.data + start, conn->in.len - start);
+    conn->in.len -= start;
+    return 0;
 }
 
-void handle_write_command(const char *command) {
-    unsigned int x, y;
-    if (sscanf(command, "AESDCHAR_IOCSEEKTO:%u,%u", &x, &y) == 2) {
-        FILE *fp = fopen(DATA_FILE, "r+");
-        if (fp == NULL) {
-            perror("fopen");
-            exit(EXIT_FAILURE);
+/**
+ * Pick the protocol of @param conn from the first byte it received.  A
+ * binary client's magic byte is consumed and echoed as the confirmation.
+ */
+void negotiate_protocol(struct connection *conn) {
+    if (conn->protocol != PROTOCOL_UNKNOWN || conn->in.len == 0) {
+        return;
+    }
+    if ((unsigned char)conn->in.data[0] != FRAME_MAGIC) {
+        conn->protocol = PROTOCOL_TEXT;
+        return;
+    }
+    conn->protocol = PROTOCOL_BINARY;
+    memmove(conn->in.data, conn->in.data + 1, --conn->in.len);
+    if (buffer_reserve(&conn->out, 1) == 0) {
+        conn->out.data[conn->out.len++] = (char)FRAME_MAGIC;
+    }
+}
+
+/**
+ * Handle everything complete in the input buffer of @param conn with the
+ * protocol it negotiated.
+ */
+int process_input(struct connection *conn) {
+    negotiate_protocol(conn);
+    if (conn->protocol == PROTOCOL_BINARY) {
+        return process_frames(conn);
+    }
+    return process_lines(conn);
+}
+
+/**
+ * Send @param len bytes at @param data on @param sock with descriptor
+ * @param fd attached as SCM_RIGHTS, so the peer receives it with the first
+ * of those bytes.
+ */
+static ssize_t send_with_fd(int sock, const char *data, size_t len, int fd) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    memset(&control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+/**
+ * Send as much queued output as the socket accepts without blocking.  A
+ * descriptor queued by FRAME_GET_FD goes out with the byte at pass_fd_at, so
+ * sends stop short of that byte until it is next.
+ * @return 0 on success (including a partial send), -1 if the peer is gone.
+ */
+int flush_output(struct connection *conn) {
+    while (conn->out_sent < conn->out.len) {
+        size_t len = conn->out.len - conn->out_sent;
+        ssize_t sent;
+        if (conn->pass_fd != -1 && conn->out_sent == conn->pass_fd_at) {
+            sent = send_with_fd(conn->client_socket, conn->out.data + conn->out_sent, len,
+                                conn->pass_fd);
+            if (sent > 0) {
+                close(conn->pass_fd);
+                conn->pass_fd = -1;
+            }
+        } else {
+            if (conn->pass_fd != -1 && conn->pass_fd_at - conn->out_sent < len) {
+                len = conn->pass_fd_at - conn->out_sent;
+            }
+            sent = send(conn->client_socket, conn->out.data + conn->out_sent, len, MSG_NOSIGNAL);
         }
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        conn->out_sent += sent;
+        metrics_add(METRIC_BYTES_OUT, sent);
+        AESD_PROBE2(send, conn->client_socket, sent);
+    }
+    conn->out.len = 0;
+    conn->out_sent = 0;
+    return 0;
+}
 
-        int fd = fileno(fp);
+/**
+ * Serve one client on a non-blocking socket.  While more than
+ * output_buffer_limit bytes of responses are waiting to be sent, the client
+ * is not read from, so a peer that doesn't drain its responses can't make
+ * the server buffer without bound.  Nor are the records streamed to a
+ * subscriber collected, which leaves them to the subscriber's own limit.
+ */
+void *connection_handler(void *arg) {
+    struct connection *conn = (struct connection *)arg;
+    int peer_closed = 0;
+    /* Receive time of the oldest data whose response isn't fully sent yet */
+    uint64_t unacked_since = 0;
 
-        struct aesd_seekto seek_data;
-        seek_data.write_cmd = x;
-        seek_data.write_cmd_offset = y;
+    while (1) {
+        struct pollfd pfd[2] = { { .fd = conn->client_socket, .events = 0 }, { .fd = -1 } };
+        size_t pending = conn->out.len - conn->out_sent;
 
-        if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seek_data) == -1) {
-            perror("ioctl AESDCHAR_IOCSEEKTO");
-            fclose(fp);
-            exit(EXIT_FAILURE);
+        if (!peer_closed && pending <= output_buffer_limit) {
+            pfd[0].events |= POLLIN;
+            if (conn->subscriber != NULL) {
+                pfd[1].fd = subscriber_wake_fd(conn);
+                pfd[1].events = POLLIN;
+            }
+        }
+        if (pending > 0) {
+            pfd[0].events |= POLLOUT;
+        }
+        if (pfd[0].events == 0) {
+            break;
         }
 
-        fclose(fp);
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (pfd[1].revents & POLLIN) {
+            if (subscriber_collect(conn) == -1) {
+                break;
+            }
+            pfd[0].revents |= POLLOUT;
+        }
+        if ((pfd[0].revents & (POLLOUT | POLLERR)) && flush_output(conn) == -1) {
+            break;
+        }
+        if (unacked_since != 0 && conn->out.len == 0) {
+            metrics_observe(METRIC_RECV_TO_ACK, metrics_now_ns() - unacked_since);
+            unacked_since = 0;
+        }
+
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (buffer_reserve(&conn->in, 1024) == -1) {
+                break;
+            }
+            ssize_t bytes_received = recv(conn->client_socket, conn->in.data + conn->in.len,
+                                          conn->in.cap - conn->in.len, 0);
+            if (bytes_received == 0) {
+                peer_closed = 1;
+            } else if (bytes_received > 0) {
+                uint64_t received_at = metrics_now_ns();
+                metrics_add(METRIC_BYTES_IN, bytes_received);
+                AESD_PROBE2(recv, conn->client_socket, bytes_received);
+                conn->in.len += bytes_received;
+                if (process_input(conn) == -1) {
+                    break;
+                }
+                if (conn->out.len > 0 && unacked_since == 0) {
+                    unacked_since = received_at;
+                }
+                if (flush_output(conn) == -1) {
+                    break;
+                }
+                if (unacked_since != 0 && conn->out.len == 0) {
+                    metrics_observe(METRIC_RECV_TO_ACK, metrics_now_ns() - unacked_since);
+                    unacked_since = 0;
+                }
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                break;
+            }
+        }
+    }
+
+    close(conn->client_socket);
+    if (conn->pass_fd != -1) {
+        close(conn->pass_fd);
     }
+    subscriber_remove(conn);
+    connection_unregister(conn);
+    metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+    return NULL;
 }
 
-void send_aesdchar_content(int client_socket) {
-    FILE *fp = fopen(DATA_FILE, "r");
-    if (fp == NULL) {
-        perror("fopen");
-        exit(EXIT_FAILURE);
+void set_accepting(struct acceptor *acc, int enable) {
+    struct epoll_event ev;
+    ev.events = enable ? EPOLLIN : 0;
+    ev.data.fd = acc->listen_fd;
+    if (epoll_ctl(acc->epoll_fd, EPOLL_CTL_MOD, acc->listen_fd, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+    acc->accepting = enable;
+}
+
+void pause_accepting(struct acceptor *acc) {
+    set_accepting(acc, 0);
+    acc->accept_paused = 1;
+    acc->pauses++;
+    clock_gettime(CLOCK_MONOTONIC, &acc->accept_resume_at);
+    acc->accept_resume_at.tv_nsec += ACCEPT_PAUSE_MS * 1000000L;
+    if (acc->accept_resume_at.tv_nsec >= 1000000000L) {
+        acc->accept_resume_at.tv_sec++;
+        acc->accept_resume_at.tv_nsec -= 1000000000L;
+    }
+}
+
+/**
+ * @return the epoll_wait() timeout in ms until a paused listener may resume,
+ * or -1 to wait indefinitely.
+ */
+int accept_pause_timeout(const struct acceptor *acc) {
+    if (!acc->accept_paused) {
+        return -1;
     }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long remaining_ms = (acc->accept_resume_at.tv_sec - now.tv_sec) * 1000 +
+                        (acc->accept_resume_at.tv_nsec - now.tv_nsec) / 1000000;
+    return remaining_ms > 0 ? (int)remaining_ms : 0;
+}
+
+/**
+ * Accept pending clients until the backlog is empty or the connection limit
+ * is reached.  At the limit the listening socket is taken out of the event
+ * loop, leaving further clients queued in the kernel backlog until a handler
+ * finishes.  Resource exhaustion pauses accepting briefly instead of exiting.
+ */
+void accept_connections(struct acceptor *acc) {
+    while (1) {
+        pthread_mutex_lock(&conn_mutex);
+        unsigned int live = live_connections;
+        pthread_mutex_unlock(&conn_mutex);
+
+        if (max_connections != 0 && live >= max_connections) {
+            set_accepting(acc, 0);
+            return;
+        }
+
+        int client_socket = accept4(acc->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket == -1) {
+            switch (errno) {
+                case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+                case EWOULDBLOCK:
+#endif
+                    return;
+                case EMFILE:
+                case ENFILE:
+                    /*
+                     * Out of descriptors: use the reserve descriptor to take
+                     * one client off the backlog and close it, so it fails
+                     * fast instead of waiting in a queue we can't serve.
+                     */
+                    syslog(LOG_WARNING, "accept: %s, shedding a connection", strerror(errno));
+                    close(acc->reserve_fd);
+                    client_socket = accept(acc->listen_fd, NULL, NULL);
+                    if (client_socket != -1) {
+                        close(client_socket);
+                        acc->shed++;
+                    }
+                    acc->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                    pause_accepting(acc);
+                    return;
+                case ENOBUFS:
+                case ENOMEM:
+                    syslog(LOG_WARNING, "accept: %s, pausing", strerror(errno));
+                    pause_accepting(acc);
+                    return;
+                default:
+                    /* ECONNABORTED, EINTR, EPROTO and friends: try the next one */
+                    acc->accept_errors++;
+                    continue;
+            }
+        }
+
+        struct connection *conn = calloc(1, sizeof(struct connection));
+        if (conn == NULL) {
+            perror("calloc");
+            close(client_socket);
+            pause_accepting(acc);
+            return;
+        }
+        conn->client_socket = client_socket;
+        conn->local = acc->local;
+        conn->pass_fd = -1;
+        conn->threaded = 1;
+        connection_register(conn);
 
-    char buffer[1024];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
-        send(client_socket, buffer, bytes_read, 0);
+        int err = 0;
+        if (connection_pool != NULL) {
+            if (!threadpool_post(connection_pool, connection_handler, conn)) {
+                err = errno;
+            }
+        } else {
+            pthread_t tid;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            err = pthread_create(&tid, &attr, connection_handler, conn);
+            pthread_attr_destroy(&attr);
+        }
+        if (err != 0) {
+            syslog(LOG_WARNING, "starting connection handler: %s", strerror(err));
+            close(client_socket);
+            connection_unregister(conn);
+            free(conn);
+            pause_accepting(acc);
+            return;
+        }
+        acc->accepted++;
+        metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
     }
+}
 
-    fclose(fp);
+int epoll_add(int epfd, int fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return -1;
+    }
+    return 0;
 }
 
-void *connection_handler(void *socket_desc) {
-    int client_socket = *(int *)socket_desc;
-    free(socket_desc);
+/**
+ * Bind @param fd to the Unix socket @param path: a filesystem path starting
+ * with '/', replacing any stale socket left there, or an abstract name
+ * starting with '@'.
+ * @return 0 on success, -1 on error.
+ */
+static int bind_unix(int fd, const char *path) {
+    struct sockaddr_un address;
+    size_t len = strlen(path);
 
-    char buffer[1024];
-    ssize_t bytes_received;
-    FILE *fp = fopen(DATA_FILE, "a+");
-    if (fp == NULL) {
-        perror("fopen");
-        pthread_exit(NULL);
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (len >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        return -1;
+    }
+    memcpy(address.sun_path, path, len);
+    if (path[0] == '@') {
+        address.sun_path[0] = '\0';
+    } else {
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&address, offsetof(struct sockaddr_un, sun_path) + len) == -1) {
+        perror("bind failed");
+        return -1;
     }
+    return 0;
+}
 
-    while ((bytes_received = recv(client_socket, buffer, sizeof(buffer), 0)) > 0) {
-        pthread_mutex_lock(&data_mutex);
+/**
+ * Open the listening socket, descriptors and epoll set of @param acc: on
+ * listen_port, or on the Unix socket @param path if it isn't NULL.  With more than
+ * one TCP acceptor every socket sets SO_REUSEPORT before binding, so the
+ * kernel spreads incoming connections across the acceptors.
+ */
+int acceptor_init(struct acceptor *acc, unsigned int index, const char *path) {
+    struct sockaddr_in address;
+
+    memset(acc, 0, sizeof(*acc));
+    acc->index = index;
+    acc->local = path != NULL;
+    acc->accepting = 1;
 
-        buffer[bytes_received] = '\0';
+    acc->listen_fd = socket(acc->local ? AF_UNIX : AF_INET,
+                            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (acc->listen_fd == -1) {
+        perror("socket failed");
+        return -1;
+    }
 
-        char *newline = strchr(buffer, '\n');
-        if (newline != NULL) {
-            if (strncmp(buffer, "AESDCHAR_IOCSEEKTO:", strlen("AESDCHAR_IOCSEEKTO:")) == 0) {
-                handle_write_command(buffer);
-            } else {
-                fprintf(fp, "%s", buffer);
-                fflush(fp);
+    if (acc->local) {
+        if (bind_unix(acc->listen_fd, path) == -1) {
+            return -1;
+        }
+    } else {
+        if (num_acceptors > 1) {
+            int one = 1;
+            if (setsockopt(acc->listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+                perror("setsockopt SO_REUSEPORT");
+                return -1;
             }
+        }
+
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(listen_port);
 
-            send_aesdchar_content(client_socket);
-            memset(buffer, 0, sizeof(buffer));
+        if (bind(acc->listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+            perror("bind failed");
+            return -1;
         }
+    }
 
-        pthread_mutex_unlock(&data_mutex);
+    if (listen(acc->listen_fd, listen_backlog) == -1) {
+        perror("listen");
+        return -1;
+    }
+
+    acc->reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    acc->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (acc->reserve_fd == -1 || acc->wake_fd == -1) {
+        perror("open reserve_fd/wake_fd");
+        return -1;
     }
 
-    close(client_socket);
-    fclose(fp);
-    pthread_exit(NULL);
+    acc->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (acc->epoll_fd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    if (epoll_add(acc->epoll_fd, acc->listen_fd) == -1 ||
+        epoll_add(acc->epoll_fd, acc->wake_fd) == -1) {
+        return -1;
+    }
+    return 0;
 }
 
-int main(int argc, char *argv[]) {
-    struct sigaction sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sa_handler = signal_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
+/**
+ * Pin the calling acceptor thread to one CPU.  Handler threads inherit the
+ * affinity of the acceptor that created them, which keeps a connection on the
+ * CPU the kernel steered it to.
+ */
+void acceptor_pin(struct acceptor *acc) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus <= 0) {
+        return;
+    }
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(acc->index % ncpus, &cpuset);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    if (err != 0) {
+        syslog(LOG_WARNING, "acceptor %u: pthread_setaffinity_np: %s", acc->index, strerror(err));
+    }
+}
 
-    sigaction(SIGINT, &sa, NULL);
-    sigaction(SIGTERM, &sa, NULL);
+/**
+ * Event loop of one acceptor.  Acceptor 0 runs on the main thread and also
+ * owns the periodic timer and the shutdown signalfd; the loop ends once
+ * server_running is cleared.
+ */
+void acceptor_loop(struct acceptor *acc) {
+    while (atomic_load(&server_running)) {
+        struct epoll_event events[8];
+        int nfds = epoll_wait(acc->epoll_fd, events, 8, accept_pause_timeout(acc));
+        if (nfds == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
 
+        if (acc->accept_paused && accept_pause_timeout(acc) == 0) {
+            acc->accept_paused = 0;
+            set_accepting(acc, 1);
+            accept_connections(acc);
+        }
+
+        for (int i = 0; i < nfds; i++) {
+            int fd = events[i].data.fd;
+            if (fd == signal_fd) {
+                atomic_store(&server_running, 0);
+            } else if (fd == timer_fd) {
+                run_periodic_tasks();
+            } else if (fd == metrics_fd) {
+                metrics_serve(metrics_fd);
+            } else if (fd == acc->wake_fd) {
+                uint64_t count;
+                if (read(acc->wake_fd, &count, sizeof(count)) > 0 && !acc->accepting &&
+                    !acc->accept_paused) {
+                    set_accepting(acc, 1);
+                    accept_connections(acc);
+                }
+            } else if (fd == acc->listen_fd) {
+                accept_connections(acc);
+            }
+        }
+    }
+}
+
+void *acceptor_thread(void *arg) {
+    struct acceptor *acc = (struct acceptor *)arg;
+    /* Local clients aren't steered by the NIC, so don't tie them to one CPU */
+    if (!acc->local) {
+        acceptor_pin(acc);
+    }
+    acceptor_loop(acc);
+    return NULL;
+}
+
+/* Wake every acceptor, e.g. because a connection slot or shutdown is pending */
+void wake_acceptors(void) {
+    uint64_t one = 1;
+    for (unsigned int i = 0; i < total_acceptors; i++) {
+        if (write(acceptors[i].wake_fd, &one, sizeof(one)) == -1) {
+            perror("write wake_fd");
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
     int daemon_mode = 0;
+    int opt;
 
-    if (argc > 1 && strcmp(argv[1], "-d") == 0) {
-        daemon_mode = 1;
+    const char *metrics_addr = NULL;
+    char replica_path[64];
+
+    while ((opt = getopt(argc, argv, "da:b:c:e:f:m:o:p:r:s:t:u:w:")) != -1) {
+        switch (opt) {
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 'e':
+                if (strcmp(optarg, "uring") == 0) {
+                    use_uring = 1;
+                } else if (strcmp(optarg, "epoll") != 0) {
+                    fprintf(stderr, "Unknown engine %s, expected epoll or uring\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                num_acceptors = strtoul(optarg, NULL, 10);
+                if (num_acceptors == 0) {
+                    num_acceptors = 1;
+                }
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                break;
+            case 'c':
+                max_connections = strtoul(optarg, NULL, 10);
+                break;
+            case 'f':
+                primary_addr = optarg;
+                break;
+            case 'm':
+                metrics_addr = optarg;
+                break;
+            case 'o':
+                output_buffer_limit = strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                listen_port = strtoul(optarg, NULL, 10);
+                if (listen_port == 0 || listen_port > 65535) {
+                    fprintf(stderr, "Invalid port %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                if (strcmp(optarg, "batch") == 0) {
+                    coalesce_responses = 1;
+                } else if (strcmp(optarg, "line") != 0) {
+                    fprintf(stderr, "Unknown response mode %s, expected line or batch\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                shm_ring_name = optarg;
+                break;
+            case 't':
+                shutdown_deadline_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'u':
+                if (optarg[0] != '/' && optarg[0] != '@') {
+                    fprintf(stderr, "Unix socket %s must be a /path or an @abstract name\n",
+                            optarg);
+                    exit(EXIT_FAILURE);
+                }
+                unix_path = optarg;
+                break;
+            case 'w':
+                pool_workers = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-d] [-e epoll|uring] [-a acceptors] [-b listen_backlog]\n"
+                        "          [-c max_connections (0 = unlimited)] [-o output_buffer_limit_bytes]\n"
+                        "          [-m metrics_port|/unix/path|@abstract] [-r line|batch]\n"
+                        "          [-s /shm_ring_name] [-t shutdown_deadline_ms] [-w pool_workers]\n"
+                        "          [-u /unix/path|@abstract] [-p port]\n"
+                        "          [-f primary_port|host:port|/unix/path|@abstract]\n"
+                        "With -e uring, the lines of each receive are answered by one read-back,\n"
+                        "as with -r batch, and every TCP client is served from the ring, so -w\n"
+                        "only applies without -u, and then only if the ring can't be set up.\n"
+                        "With -f, follow the primary and serve read-backs of a copy of its\n"
+                        "history.  Lines that would be written are refused with an error line;\n"
+                        "read it with AESDCHAR_IOCFILTER:prefix, or the framed protocol.\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (primary_addr != NULL) {
+        if (shm_ring_name != NULL) {
+            fprintf(stderr, "A follower (-f) takes no writes, so no shared memory ring (-s)\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(replica_path, sizeof(replica_path), REPLICA_FILE_FORMAT, listen_port);
+        data_path = replica_path;
+    }
+
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&conn_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    /*
+     * SIGINT/SIGTERM are consumed through a signalfd in the event loop.  They
+     * are blocked before any thread exists so every thread inherits the mask.
+     */
+    sigset_t shutdown_signals;
+    sigemptyset(&shutdown_signals);
+    sigaddset(&shutdown_signals, SIGINT);
+    sigaddset(&shutdown_signals, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &shutdown_signals, NULL) != 0) {
+        perror("pthread_sigmask");
+        exit(EXIT_FAILURE);
     }
 
     if (daemon_mode) {
@@ -197,78 +1313,170 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
+    /* The io_uring engine serves every connection from a single ring */
+    if (use_uring) {
+        num_acceptors = 1;
+    }
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("socket failed");
+    total_acceptors = num_acceptors + (unix_path != NULL);
+    acceptors = calloc(total_acceptors, sizeof(struct acceptor));
+    if (acceptors == NULL) {
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
+    for (unsigned int i = 0; i < total_acceptors; i++) {
+        if (acceptor_init(&acceptors[i], i, i < num_acceptors ? NULL : unix_path) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    /* A follower's replica starts empty and is rewritten in place as it syncs */
+    data_fd = open(data_path,
+                   primary_addr != NULL ? O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC
+                                        : O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                   0644);
+    if (data_fd == -1) {
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
 
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
-        perror("bind failed");
+    /* What the device kept from before we started is what snapshots begin with */
+    if (primary_addr == NULL) {
+        pthread_mutex_lock(&data_mutex);
+        history_seed();
+        pthread_mutex_unlock(&data_mutex);
+    }
+
+    /* Followers get the primary's timestamps with the rest of its records */
+    if (primary_addr == NULL && start_periodic_tasks() == -1) {
         exit(EXIT_FAILURE);
     }
 
-    if (listen(server_fd, 3) == -1) {
-        perror("listen");
+    signal_fd = signalfd(-1, &shutdown_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        perror("signalfd");
         exit(EXIT_FAILURE);
     }
 
-#ifndef USE_AESD_CHAR_DEVICE
-    pthread_t timestamp_thread;
-    if (pthread_create(&timestamp_thread, NULL, append_timestamp, NULL) != 0) {
-        perror("pthread_create");
+    if (metrics_addr != NULL && (metrics_fd = metrics_listen(metrics_addr)) == -1) {
         exit(EXIT_FAILURE);
     }
-#endif
 
-    while (1) {
-        int *new_socket = malloc(sizeof(int));
-        if (new_socket == NULL) {
-            perror("malloc");
-            exit(EXIT_FAILURE);
-        }
+    if (primary_addr != NULL && follower_start() == -1) {
+        exit(EXIT_FAILURE);
+    }
 
-        *new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t*)&addrlen);
-        if (*new_socket == -1) {
-            perror("accept");
-            free(new_socket);
+    if (shm_ring_name != NULL) {
+        if (shm_ring_create(&shm_ring, shm_ring_name, SHM_RING_CAPACITY) == -1) {
+            perror("shm_ring_create");
             exit(EXIT_FAILURE);
         }
-
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, connection_handler, (void *)new_socket) != 0) {
+        if (pthread_create(&shm_ring_tid, NULL, shm_ring_consumer, NULL) != 0) {
             perror("pthread_create");
-            free(new_socket);
             exit(EXIT_FAILURE);
         }
+    }
+
+    /* The main thread runs acceptor 0, which also owns timers, signals and metrics */
+    if ((timer_fd != -1 && epoll_add(acceptors[0].epoll_fd, timer_fd) == -1) ||
+        (metrics_fd != -1 && epoll_add(acceptors[0].epoll_fd, metrics_fd) == -1) ||
+        epoll_add(acceptors[0].epoll_fd, signal_fd) == -1) {
+        exit(EXIT_FAILURE);
+    }
 
-        ThreadNode *new_node = (ThreadNode *)malloc(sizeof(ThreadNode));
-        if (new_node == NULL) {
-            perror("malloc");
+    /*
+     * The io_uring engine only serves the TCP socket; the Unix socket keeps
+     * its own epoll acceptor, with a handler thread per connection, running
+     * alongside the ring.  Acceptors below `started` already have a thread.
+     */
+    unsigned int started = 1;
+    if (use_uring && unix_path != NULL) {
+        if (pthread_create(&acceptors[1].tid, NULL, acceptor_thread, &acceptors[1]) != 0) {
+            perror("pthread_create");
             exit(EXIT_FAILURE);
         }
-        new_node->tid = tid;
-        new_node->next = NULL;
+        started = 2;
+    }
 
-        pthread_mutex_lock(&data_mutex);
+    if (use_uring && uring_engine_run() == -1) {
+        /* Back on epoll, whose appends hold data_mutex: subscribing is safe again */
+        atomic_store(&use_uring, 0);
+    }
+    if (!use_uring) {
+        /*
+         * Every pooled connection holds its worker until the client goes
+         * away, so admitting more connections than workers would only park
+         * them in the pool queue; leave them in the listen backlog instead.
+         * The pool can't be swapped in under an acceptor that is running.
+         */
+        if (pool_workers > 0 && started == 1) {
+            if (max_connections == 0 || max_connections > pool_workers) {
+                max_connections = pool_workers;
+            }
+            connection_pool = threadpool_create(pool_workers, pool_workers);
+            if (connection_pool == NULL) {
+                exit(EXIT_FAILURE);
+            }
+        }
 
-        if (thread_list == NULL) {
-            thread_list = new_node;
-        } else {
-            ThreadNode *current = thread_list;
-            while (current->next != NULL) {
-                current = current->next;
+        for (unsigned int i = started; i < total_acceptors; i++) {
+            if (pthread_create(&acceptors[i].tid, NULL, acceptor_thread, &acceptors[i]) != 0) {
+                perror("pthread_create");
+                exit(EXIT_FAILURE);
             }
-            current->next = new_node;
+        }
+        if (num_acceptors > 1) {
+            acceptor_pin(&acceptors[0]);
         }
 
-        pthread_mutex_unlock(&data_mutex);
+        acceptor_loop(&acceptors[0]);
+    }
+
+    syslog(LOG_INFO, "Caught signal, exiting");
+
+    wake_acceptors();
+    for (unsigned int i = 0; i < total_acceptors; i++) {
+        if (i > 0) {
+            pthread_join(acceptors[i].tid, NULL);
+        }
+        close(acceptors[i].listen_fd);
+        syslog(LOG_INFO, "acceptor %u: accepted %lu, shed %lu, pauses %lu, errors %lu", i,
+               acceptors[i].accepted, acceptors[i].shed, acceptors[i].pauses,
+               acceptors[i].accept_errors);
+    }
+    drain_connections();
+    if (connection_pool != NULL) {
+        threadpool_destroy(connection_pool);
+    }
+    if (primary_addr != NULL) {
+        follower_stop();
+    }
+    if (shm_ring_name != NULL) {
+        /* The consumer commits everything already published before it exits */
+        pthread_join(shm_ring_tid, NULL);
+        shm_ring_close(&shm_ring);
+        shm_unlink(shm_ring_name);
+    }
+
+    /* Don't let the process exit in the middle of a record write */
+    pthread_mutex_lock(&data_mutex);
+    close(data_fd);
+#ifdef USE_AESD_CHAR_DEVICE
+    if (primary_addr != NULL) {
+        remove(data_path);
+    }
+#else
+    remove(data_path);
+#endif
+    close(signal_fd);
+    if (metrics_fd != -1) {
+        close(metrics_fd);
+        if (metrics_addr[0] == '/') {
+            unlink(metrics_addr);
+        }
+    }
+    if (unix_path != NULL && unix_path[0] == '/') {
+        unlink(unix_path);
     }
 
     return 0;
@@ -0,0 +1,243 @@
+/*
+ * aesdsocket.h
+ *
+ * Definitions shared between the aesdsocket event loops: the default
+ * epoll/thread-per-connection engine in aesdsocket.c and the io_uring engine
+ * in aesdsocket-uring.c.
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+
+#define PORT 9000
+#define USE_AESD_CHAR_DEVICE
+
+#ifdef USE_AESD_CHAR_DEVICE
+#define DATA_FILE "/dev/aesdchar"
+#else
+#define DATA_FILE "/var/tmp/aesdsocketdata"
+#endif
+/* A follower's copy of its primary's history, per listening port */
+#define REPLICA_FILE_FORMAT "/var/tmp/aesdsocketdata.replica.%u"
+
+#define DEFAULT_SHUTDOWN_DEADLINE_MS 5000
+#define DEFAULT_LISTEN_BACKLOG SOMAXCONN
+#define DEFAULT_MAX_CONNECTIONS 512
+#define DEFAULT_OUTPUT_BUFFER_LIMIT (1024 * 1024)
+#define ACCEPT_PAUSE_MS 100
+
+/*
+ * Binary framed protocol.  A client selects it by sending FRAME_MAGIC as the
+ * very first byte of the connection (it can never start a text command) and
+ * the server confirms by sending FRAME_MAGIC back.  From then on both sides
+ * exchange frames of a FRAME_HEADER_SIZE header followed by the payload:
+ *
+ *   u8 opcode | u8 status | u16 reserved | u32 payload length
+ *
+ * All integers are big-endian.  Requests carry status 0; every request is
+ * answered by exactly one response, in order, echoing its opcode, so clients
+ * may pipeline any number of requests.
+ */
+#define FRAME_MAGIC 0xAE
+#define FRAME_HEADER_SIZE 8
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum frame_opcode {
+    /* Payload: the record, arbitrary bytes.  Response: empty */
+    FRAME_APPEND = 1,
+    /*
+     * Payload: u32 write_cmd, u32 write_cmd_offset.  Response: the history
+     * from that position, as AESDCHAR_IOCSEEKTO answers a text client
+     */
+    FRAME_SEEK = 2,
+    /* Payload: u64 offset, u32 length.  Response: up to length bytes */
+    FRAME_READ_RANGE = 3,
+    /* Payload: empty.  Response: u64 data size, u64 frames, u64 pending output */
+    FRAME_STATS = 4,
+    /*
+     * Payload: empty.  Response: u64 data size, with a read-only descriptor of
+     * data_path attached to the response header as SCM_RIGHTS ancillary data,
+     * so a local reader can read the history itself.  Unix socket clients only.
+     */
+    FRAME_GET_FD = 5,
+    /*
+     * Payload: u8 AESD_FILTER_SUBSTRING or AESD_FILTER_PREFIX, then the
+     * pattern.  Response: the entries matching it, oldest first
+     */
+    FRAME_FILTER = 6,
+    /*
+     * Payload: empty.  Response: u32 number of entries the history keeps
+     * (0: unlimited), after which the connection is a replication stream:
+     * FRAME_RECORD frames carry a snapshot of the history, then every record
+     * committed from then on.  Responses to later requests are interleaved
+     * with them.  Connections served by a handler thread only, and not by a
+     * primary running the io_uring engine, whose appends don't take
+     * data_mutex and so can't be ordered against the snapshot.
+     */
+    FRAME_SUBSCRIBE = 7,
+    /*
+     * Never requested.  Payload: the bytes of one write, in commit order; in
+     * a snapshot, one history entry, or a chunk of an unlimited history
+     */
+    FRAME_RECORD = 8,
+};
+
+enum frame_status {
+    FRAME_OK = 0,
+    FRAME_BAD_OPCODE = 1,
+    FRAME_BAD_PAYLOAD = 2,
+    FRAME_IO_ERROR = 3,
+    /* The request needs a transport this connection doesn't use */
+    FRAME_UNSUPPORTED = 4,
+};
+
+enum protocol {
+    PROTOCOL_UNKNOWN = 0,
+    PROTOCOL_TEXT,
+    PROTOCOL_BINARY,
+};
+
+struct io_buffer {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+/*
+ * One live client connection.  Connections sit on an intrusive doubly linked
+ * list so a finishing handler thread can unlink itself in O(1); handler
+ * threads are detached, so nothing is kept around once a client goes away.
+ */
+struct connection {
+    int client_socket;
+    /* Chosen by the first byte the client sends */
+    enum protocol protocol;
+    /* Received bytes not yet forming a complete line or frame */
+    struct io_buffer in;
+    /* Responses waiting to be sent, out_sent bytes of which already went out */
+    struct io_buffer out;
+    size_t out_sent;
+    /* Binary frames handled so far */
+    uint64_t frames;
+    /* Accepted on the Unix socket, so descriptors can be passed to the peer */
+    int local;
+    /* Descriptor to send with the output byte at pass_fd_at, or -1 */
+    int pass_fd;
+    size_t pass_fd_at;
+    /* Served by its own connection_handler() loop, which can stream to it */
+    int threaded;
+    /* Set once the peer subscribed with FRAME_SUBSCRIBE */
+    struct subscriber *subscriber;
+    struct connection *prev;
+    struct connection *next;
+};
+
+/*
+ * One listening socket and the event loop accepting from it.  All fields
+ * are owned by the acceptor's own thread, apart from wake_fd, which handlers
+ * signal when a slot frees up below max_connections.
+ */
+struct acceptor {
+    unsigned int index;
+    /* Listening on the Unix socket rather than on PORT */
+    int local;
+    int listen_fd;
+    int epoll_fd;
+    int wake_fd;
+    /* Spare descriptor given up to shed a client when we run out of fds */
+    int reserve_fd;
+    int accepting;
+    int accept_paused;
+    struct timespec accept_resume_at;
+    pthread_t tid;
+    unsigned long accepted;
+    unsigned long shed;
+    unsigned long pauses;
+    unsigned long accept_errors;
+};
+
+extern pthread_mutex_t data_mutex;
+extern unsigned int shutdown_deadline_ms;
+extern unsigned int max_connections;
+extern size_t output_buffer_limit;
+extern int data_fd;
+extern int signal_fd;
+extern int timer_fd;
+extern int metrics_fd;
+extern atomic_int server_running;
+extern struct acceptor *acceptors;
+/* What read-backs read: DATA_FILE, or the replica kept by a follower */
+extern const char *data_path;
+/* With -f, this instance is a read-only follower of the primary at this address */
+extern const char *primary_addr;
+/* The io_uring engine is serving the TCP socket */
+extern atomic_int use_uring;
+
+int buffer_reserve(struct io_buffer *buf, size_t extra);
+/**
+ * Append the entries of data_path matching the @param len byte
+ * @param pattern under AESD_FILTER_* @param mode to the output buffer of
+ * @param conn.  Called with data_mutex held, like read_aesdchar_content().
+ * @return 0 on success (an invalid mode or pattern matches nothing), -1 on error.
+ */
+int read_filtered_content(struct connection *conn, uint32_t mode, const char *pattern,
+                          size_t len);
+/**
+ * Append data_path from byte @param write_cmd_offset of write command
+ * @param write_cmd on to the output buffer of @param conn.  The
+ * AESDCHAR_IOCSEEKTO ioctl and the read share one descriptor, so the seek
+ * moves no other reader's.  Called with data_mutex held.
+ * @return 0 on success, 1 if the device refused the position, -1 on error.
+ */
+int read_content_from(struct connection *conn, uint32_t write_cmd, uint32_t write_cmd_offset);
+void negotiate_protocol(struct connection *conn);
+int process_input(struct connection *conn);
+int process_lines(struct connection *conn);
+int process_frames(struct connection *conn);
+void run_periodic_tasks(void);
+
+/**
+ * Answer FRAME_SUBSCRIBE: queue the response and the snapshot of the
+ * history on @param conn and stream it every record committed from then on.
+ * @return 0 on success, -1 if out of memory.
+ */
+int frame_subscribe(struct connection *conn);
+/**
+ * Stream the @param iovcnt buffers at @param iov, just committed, to every
+ * subscriber.  Called with data_mutex held, right after the write.
+ */
+void replicate(const struct iovec *iov, int iovcnt);
+/**
+ * A write failed, possibly after committing part of it, so the subscribers
+ * may no longer hold what the history does: drop them all, to resubscribe
+ * from a fresh snapshot.  Called with data_mutex held.
+ */
+void replicate_failed(void);
+/**
+ * Load the history mirror a primary cuts snapshots from with what
+ * data_path holds, one entry per line.  Called with data_mutex held.
+ * @return 0 on success or with an unlimited history, -1 on error.
+ */
+int history_seed(void);
+int subscriber_wake_fd(const struct connection *conn);
+/**
+ * Move the records streamed to the subscriber @param conn since the last
+ * call to its output buffer.
+ * @return 0 on success, -1 if it fell too far behind and must be dropped.
+ */
+int subscriber_collect(struct connection *conn);
+void subscriber_remove(struct connection *conn);
+int follower_start(void);
+void follower_stop(void);
+
+int uring_engine_run(void);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,177 @@
+/**
+ * @file shm-ring-bench.c
+ * @brief Records per second through the shared-memory ring against a Unix socket
+ *
+ * Usage: shm-ring-bench [records_per_producer] [max_producers]
+ * For every record size and producer count (1, 2, 4, ... max_producers),
+ * forked producer processes send records_per_producer records each to the
+ * parent, which consumes and checks them.  The same traffic is sent two ways:
+ *  - shm_ring_push() into an anonymous ring, consumed SHM_RING_BATCH records
+ *    per shm_ring_peek(), with no system call per record on either side
+ *  - one send() per record on a SOCK_SEQPACKET socketpair, one recv() each,
+ *    as a local producer talking to aesdsocket over a socket would
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "aesd-shm-ring.h"
+
+#define RING_CAPACITY (1024 * 1024)
+#define SHM_RING_BATCH 64
+#define MAX_RECORD 4096
+
+static const size_t record_sizes[] = { 16, 64, 256, 1024 };
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fill_record(char *record, size_t size, unsigned int producer) {
+    memset(record, 'a' + producer % 26, size);
+    record[size - 1] = '\n';
+}
+
+static void wait_producers(unsigned int producers) {
+    for (unsigned int i = 0; i < producers; i++) {
+        int status;
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "producer failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static double bench_ring(unsigned long records, unsigned int producers, size_t size) {
+    struct shm_ring ring;
+    char record[MAX_RECORD];
+
+    if (shm_ring_create(&ring, NULL, RING_CAPACITY) == -1) {
+        perror("shm_ring_create");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now_s();
+    for (unsigned int p = 0; p < producers; p++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            fill_record(record, size, p);
+            for (unsigned long i = 0; i < records; i++) {
+                while (shm_ring_push(&ring, record, size) == -1) {
+                    if (errno != EAGAIN) {
+                        _exit(EXIT_FAILURE);
+                    }
+                    sched_yield();
+                }
+            }
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    unsigned long received = 0, total = records * producers;
+    while (received < total) {
+        struct iovec iov[SHM_RING_BATCH];
+        uint64_t consumed;
+        int count = shm_ring_peek(&ring, iov, SHM_RING_BATCH, &consumed);
+        if (count == -1) {
+            perror("shm_ring_peek");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < count; i++) {
+            if (iov[i].iov_len != size || ((char *)iov[i].iov_base)[size - 1] != '\n') {
+                fprintf(stderr, "bad record\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (consumed == 0) {
+            shm_ring_wait(&ring, 10);
+            continue;
+        }
+        shm_ring_consume(&ring, consumed);
+        received += count;
+    }
+    double rate = total / (now_s() - start);
+
+    wait_producers(producers);
+    shm_ring_close(&ring);
+    return rate;
+}
+
+static double bench_socket(unsigned long records, unsigned int producers, size_t size) {
+    int sv[2];
+    char record[MAX_RECORD];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        exit(EXIT_FAILURE);
+    }
+
+    double start = now_s();
+    for (unsigned int p = 0; p < producers; p++) {
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork");
+            exit(EXIT_FAILURE);
+        }
+        if (pid == 0) {
+            close(sv[0]);
+            fill_record(record, size, p);
+            for (unsigned long i = 0; i < records; i++) {
+                if (send(sv[1], record, size, 0) != (ssize_t)size) {
+                    _exit(EXIT_FAILURE);
+                }
+            }
+            _exit(EXIT_SUCCESS);
+        }
+    }
+
+    unsigned long received = 0, total = records * producers;
+    while (received < total) {
+        ssize_t n = recv(sv[0], record, sizeof(record), 0);
+        if (n != (ssize_t)size || record[size - 1] != '\n') {
+            fprintf(stderr, "bad record\n");
+            exit(EXIT_FAILURE);
+        }
+        received++;
+    }
+    double rate = total / (now_s() - start);
+
+    wait_producers(producers);
+    close(sv[0]);
+    close(sv[1]);
+    return rate;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long records = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int max_producers = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                          : (cpus > 1 ? (unsigned int)cpus - 1 : 1);
+
+    printf("%-7s %9s %16s %16s %8s\n", "bytes", "producers", "ring records/s", "socket records/s",
+           "speedup");
+    for (size_t s = 0; s < sizeof(record_sizes) / sizeof(record_sizes[0]); s++) {
+        for (unsigned int producers = 1; producers <= max_producers; producers *= 2) {
+            double ring = bench_ring(records, producers, record_sizes[s]);
+            double sock = bench_socket(records, producers, record_sizes[s]);
+            printf("%-7zu %9u %16.0f %16.0f %7.1fx\n", record_sizes[s], producers, ring, sock,
+                   ring / sock);
+            fflush(stdout);
+        }
+    }
+    return EXIT_SUCCESS;
+}
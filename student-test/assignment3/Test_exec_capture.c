@@ -0,0 +1,99 @@
+#include "unity.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+/* Well past the 64 KiB a pipe holds, on each of stdout and stderr */
+#define CAPTURE_LARGE_SIZE 300000
+
+/**
+* Captures stdout and stderr of one command into separate buffers.
+*/
+void test_exec_capture_stdout_stderr()
+{
+    struct exec_output out = { 0 };
+    struct exec_output err = { 0 };
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&out, &err, 0, false, 3, "/bin/sh", "-c",
+            "echo to stdout; echo to stderr >&2"), "The command should succeed");
+    TEST_ASSERT_NOT_NULL(out.data);
+    TEST_ASSERT_NOT_NULL(err.data);
+    TEST_ASSERT_EQUAL_STRING("to stdout\n", out.data);
+    TEST_ASSERT_EQUAL_STRING("to stderr\n", err.data);
+    free(out.data);
+    free(err.data);
+}
+
+/**
+* A command writing more than a pipe holds to both streams must not deadlock,
+* and every byte must be captured.
+*/
+void test_exec_capture_large_output()
+{
+    struct exec_output out = { 0 };
+    struct exec_output err = { 0 };
+
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_capture(&out, &err, 10000, true, 3, "/bin/sh", "-c",
+            "head -c 300000 /dev/zero >&2; head -c 300000 /dev/zero"),
+            "Filling both pipes should neither deadlock nor time out");
+    TEST_ASSERT_EQUAL_MESSAGE(CAPTURE_LARGE_SIZE, out.len, "All of stdout should be captured");
+    TEST_ASSERT_EQUAL_MESSAGE(CAPTURE_LARGE_SIZE, err.len, "All of stderr should be captured");
+    free(out.data);
+    free(err.data);
+}
+
+/**
+* A non-zero exit status fails the call but keeps the output captured so far.
+*/
+void test_exec_capture_exit_status()
+{
+    struct exec_output out = { 0 };
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(&out, NULL, 0, false, 3, "/bin/sh", "-c",
+            "echo partial; exit 3"), "A non-zero exit status must not report success");
+    TEST_ASSERT_NOT_NULL(out.data);
+    TEST_ASSERT_EQUAL_STRING("partial\n", out.data);
+    free(out.data);
+}
+
+/**
+* A command that can't be started fails without capturing anything, and one
+* outliving its timeout is killed and reported with ETIMEDOUT.
+*/
+void test_exec_capture_exec_failure_and_timeout()
+{
+    struct exec_output out = { 0 };
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(&out, NULL, 0, false, 1, "/does/not/exist"),
+            "A missing command must not report success");
+    TEST_ASSERT_EQUAL(0, out.len);
+
+    errno = 0;
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(&out, NULL, 200, true, 2, "/bin/sleep", "10"),
+            "A command killed at its timeout must not report success");
+    TEST_ASSERT_EQUAL_MESSAGE(ETIMEDOUT, errno, "A timeout should set errno to ETIMEDOUT");
+    free(out.data);
+}
+
+/**
+* The timeout holds with nothing captured, and after the command closes the
+* only pipe it was given.
+*/
+void test_exec_capture_timeout_without_pipes()
+{
+    struct exec_output out = { 0 };
+
+    errno = 0;
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(NULL, NULL, 200, true, 2, "/bin/sleep", "10"),
+            "A command killed at its timeout must not report success");
+    TEST_ASSERT_EQUAL_MESSAGE(ETIMEDOUT, errno, "A timeout should set errno to ETIMEDOUT");
+
+    errno = 0;
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_capture(&out, NULL, 200, true, 3, "/bin/sh", "-c",
+            "exec >&-; sleep 10"), "Closing stdout must not lift the timeout");
+    TEST_ASSERT_EQUAL_MESSAGE(ETIMEDOUT, errno, "A timeout should set errno to ETIMEDOUT");
+    free(out.data);
+}
@@ -0,0 +1,72 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define EXEC_MANY_BATCH 500
+#define EXEC_MANY_OUTPUT "/tmp/exec_many_output.txt"
+
+/**
+* Runs a large batch of /bin/true and /bin/false with a small concurrency limit
+* and checks that every result lands in the slot of the command that produced it.
+*/
+void test_exec_many_batch()
+{
+    static char *true_argv[] = { "/bin/true", NULL };
+    static char *false_argv[] = { "/bin/false", NULL };
+    static struct exec_command commands[EXEC_MANY_BATCH];
+    static struct exec_result results[EXEC_MANY_BATCH];
+
+    for (int i = 0; i < EXEC_MANY_BATCH; i++)
+    {
+        commands[i].argv = (i % 7 == 3) ? false_argv : true_argv;
+        commands[i].outputfile = NULL;
+    }
+
+    TEST_ASSERT_FALSE_MESSAGE(do_exec_many(commands, EXEC_MANY_BATCH, 16, results),
+            "A batch containing /bin/false must not report success");
+    for (int i = 0; i < EXEC_MANY_BATCH; i++)
+    {
+        TEST_ASSERT_TRUE_MESSAGE(results[i].started, "Every command should have been started");
+        TEST_ASSERT_EQUAL_MESSAGE(i % 7 != 3, results[i].success,
+                "Results must be returned in submission order");
+    }
+
+    for (int i = 0; i < EXEC_MANY_BATCH; i++)
+    {
+        commands[i].argv = true_argv;
+    }
+    TEST_ASSERT_TRUE_MESSAGE(do_exec_many(commands, EXEC_MANY_BATCH, 0, results),
+            "A batch of /bin/true should succeed without a concurrency limit");
+}
+
+/**
+* Checks that a command which can't be started is reported without holding up the rest,
+* and that stdout redirection works per command.
+*/
+void test_exec_many_redirect_and_failures()
+{
+    char *echo_argv[] = { "/bin/echo", "exec many", NULL };
+    char *missing_argv[] = { "/does/not/exist", NULL };
+    struct exec_command commands[] = {
+        { echo_argv, EXEC_MANY_OUTPUT },
+        { missing_argv, NULL },
+        { echo_argv, "/dev/null" },
+    };
+    struct exec_result results[3];
+
+    TEST_ASSERT_FALSE(do_exec_many(commands, 3, 2, results));
+    TEST_ASSERT_TRUE(results[0].success);
+    TEST_ASSERT_FALSE(results[1].started);
+    TEST_ASSERT_TRUE(results[2].success);
+
+    char buffer[32] = { 0 };
+    FILE *fp = fopen(EXEC_MANY_OUTPUT, "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(fp, "The redirected output file should exist");
+    TEST_ASSERT_NOT_NULL(fgets(buffer, sizeof(buffer), fp));
+    fclose(fp);
+    remove(EXEC_MANY_OUTPUT);
+    TEST_ASSERT_EQUAL_STRING("exec many\n", buffer);
+}
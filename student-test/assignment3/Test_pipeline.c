@@ -0,0 +1,81 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../examples/systemcalls/systemcalls.h"
+
+#define PIPELINE_OUTPUT "/tmp/pipeline_output.txt"
+
+/**
+* Runs echo | tr | cat > file and checks the output went through every stage.
+*/
+void test_pipeline_success()
+{
+    char *echo_argv[] = { "/bin/echo", "pipeline stages", NULL };
+    char *tr_argv[] = { "/usr/bin/tr", "a-z", "A-Z", NULL };
+    char *cat_argv[] = { "/bin/cat", NULL };
+    struct pipeline_stage stages[] = {
+        { echo_argv, NULL, NULL, false },
+        { tr_argv, NULL, NULL, false },
+        { cat_argv, PIPELINE_OUTPUT, NULL, false },
+    };
+
+    TEST_ASSERT_TRUE_MESSAGE(do_pipeline(stages, 3), "echo | tr | cat should succeed");
+
+    char buffer[32] = { 0 };
+    FILE *fp = fopen(PIPELINE_OUTPUT, "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(fp, "The last stage should have created its output file");
+    TEST_ASSERT_NOT_NULL(fgets(buffer, sizeof(buffer), fp));
+    fclose(fp);
+    remove(PIPELINE_OUTPUT);
+    TEST_ASSERT_EQUAL_STRING("PIPELINE STAGES\n", buffer);
+}
+
+/**
+* A stage exiting with a non-zero status fails the whole pipeline, as with
+* pipefail, while the stages after it still run to completion.
+*/
+void test_pipeline_failing_middle_stage()
+{
+    char *echo_argv[] = { "/bin/echo", "lost", NULL };
+    char *false_argv[] = { "/bin/false", NULL };
+    char *cat_argv[] = { "/bin/cat", NULL };
+    struct pipeline_stage stages[] = {
+        { echo_argv, NULL, NULL, false },
+        { false_argv, NULL, NULL, false },
+        { cat_argv, PIPELINE_OUTPUT, NULL, false },
+    };
+
+    TEST_ASSERT_FALSE_MESSAGE(do_pipeline(stages, 3),
+            "A pipeline with /bin/false in the middle must not report success");
+
+    char buffer[32] = { 0 };
+    FILE *fp = fopen(PIPELINE_OUTPUT, "r");
+    TEST_ASSERT_NOT_NULL_MESSAGE(fp, "The stage after the failing one should still have run");
+    TEST_ASSERT_NULL_MESSAGE(fgets(buffer, sizeof(buffer), fp),
+            "Nothing should get past a stage that reads nothing and writes nothing");
+    fclose(fp);
+    remove(PIPELINE_OUTPUT);
+}
+
+/**
+* A stage that can't be started fails the pipeline without leaving the
+* stages already started waiting on it.
+*/
+void test_pipeline_exec_failure()
+{
+    char *echo_argv[] = { "/bin/echo", "nowhere", NULL };
+    char *missing_argv[] = { "/does/not/exist", NULL };
+    char *cat_argv[] = { "/bin/cat", NULL };
+    struct pipeline_stage stages[] = {
+        { echo_argv, NULL, NULL, false },
+        { missing_argv, NULL, NULL, false },
+        { cat_argv, "/dev/null", NULL, false },
+    };
+
+    TEST_ASSERT_FALSE_MESSAGE(do_pipeline(stages, 3),
+            "A pipeline with a missing command must not report success");
+    TEST_ASSERT_FALSE_MESSAGE(do_pipeline(&stages[1], 1),
+            "A single missing command must not report success");
+}
@@ -0,0 +1,148 @@
+/**
+ * @file circular-buffer-bench.c
+ * @brief Throughput of aesd_circular_buffer_add_entry() and
+ * aesd_circular_buffer_find_entry_offset_for_fpos()
+ *
+ * Usage: circular-buffer-bench [operations]
+ * For every entry count (1 up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) and
+ * entry size distribution, the buffer is filled with that many entries and
+ * timed for:
+ *  - add: adding [operations] more entries; once the buffer is full every
+ *    add takes the overwrite path and the offsets wrap around the array
+ *  - find: looking up [operations] offsets spread uniformly over the stored
+ *    bytes, plus one past the end, so every entry position is exercised
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define MAX_ENTRY_SIZE 4096
+
+enum size_distribution
+{
+    SIZES_SMALL,
+    SIZES_PAGE,
+    SIZES_MIXED,
+    SIZES_MAX,
+};
+
+static const char *size_names[SIZES_MAX] = { "8B", "4KiB", "1B-4KiB" };
+
+static char payload[MAX_ENTRY_SIZE];
+/* Keeps the compiler from dropping lookups whose results aren't otherwise used */
+static volatile size_t sink;
+
+static uint32_t rng_state = 2463534242u;
+
+static uint32_t xorshift32(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static size_t entry_size(enum size_distribution sizes)
+{
+    switch (sizes)
+    {
+        case SIZES_SMALL:
+            return 8;
+        case SIZES_PAGE:
+            return MAX_ENTRY_SIZE;
+        default:
+            return 1 + xorshift32() % MAX_ENTRY_SIZE;
+    }
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Reset @param buffer and add @param entries entries drawn from @param sizes.
+ * @return the number of bytes stored.
+ */
+static size_t fill(struct aesd_circular_buffer *buffer, int entries, enum size_distribution sizes)
+{
+    size_t total = 0;
+    aesd_circular_buffer_init(buffer);
+    for (int i = 0; i < entries; i++)
+    {
+        struct aesd_buffer_entry entry = { payload, entry_size(sizes) };
+        aesd_circular_buffer_add_entry(buffer, &entry);
+        total += entry.size;
+    }
+    return total;
+}
+
+static double bench_add(int entries, enum size_distribution sizes, unsigned long operations)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry added[256];
+
+    fill(&buffer, entries, sizes);
+    /* Sizes are drawn up front so the timed loop measures only the buffer */
+    for (int i = 0; i < 256; i++)
+    {
+        added[i].buffptr = payload;
+        added[i].size = entry_size(sizes);
+    }
+
+    double start = now_s();
+    for (unsigned long i = 0; i < operations; i++)
+    {
+        aesd_circular_buffer_add_entry(&buffer, &added[i & 255]);
+    }
+    double elapsed = now_s() - start;
+    sink += buffer.in_offs;
+    return operations / elapsed;
+}
+
+static double bench_find(int entries, enum size_distribution sizes, unsigned long operations)
+{
+    struct aesd_circular_buffer buffer;
+    size_t offsets[1024];
+
+    size_t total = fill(&buffer, entries, sizes);
+    for (int i = 0; i < 1024; i++)
+    {
+        offsets[i] = xorshift32() % (total + 1);
+    }
+
+    double start = now_s();
+    for (unsigned long i = 0; i < operations; i++)
+    {
+        size_t entry_offset = 0;
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offsets[i & 1023], &entry_offset);
+        sink += entry_offset + (entry != NULL);
+    }
+    return operations / (now_s() - start);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long operations = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    static const int entry_counts[] = { 1, 2, 5, 9, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED };
+
+    printf("%-8s %7s %16s %16s\n", "sizes", "entries", "add/s", "find/s");
+    for (int sizes = 0; sizes < SIZES_MAX; sizes++)
+    {
+        for (size_t i = 0; i < sizeof(entry_counts) / sizeof(entry_counts[0]); i++)
+        {
+            int entries = entry_counts[i];
+            double add = bench_add(entries, (enum size_distribution)sizes, operations);
+            double find = bench_find(entries, (enum size_distribution)sizes, operations);
+            printf("%-8s %7d %16.0f %16.0f\n", size_names[sizes], entries, add, find);
+            fflush(stdout);
+        }
+    }
+    return EXIT_SUCCESS;
+}
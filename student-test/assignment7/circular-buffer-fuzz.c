@@ -0,0 +1,195 @@
+/**
+ * @file circular-buffer-fuzz.c
+ * @brief Fuzz harness checking aesd-circular-buffer.c against a naive model
+ *
+ * The input is read as a sequence of operations:
+ *  - 0x00-0x7f: add an entry whose size is the next byte (0 to 255 bytes)
+ *  - 0x80-0xff: look up the offset in the next two bytes (big-endian)
+ * The model keeps the sizes of the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * entries in a plain array, oldest first, and finds an offset by walking it.
+ * Every lookup must return the same entry and byte offset as the model, and
+ * the buffer indices must stay consistent with the number of entries added.
+ *
+ * Built with -DCIRCULAR_BUFFER_LIBFUZZER and -fsanitize=fuzzer, this is a
+ * libFuzzer target.  Otherwise main() runs every file named on the command
+ * line (as AFL does, with @@) or stdin, or, given -runs=N, N random inputs.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+#define MAX_INPUT 65536
+#define RANDOM_INPUT_MAX 512
+
+#define CHECK(cond)                                                                          \
+    do                                                                                       \
+    {                                                                                        \
+        if (!(cond))                                                                         \
+        {                                                                                    \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);         \
+            abort();                                                                         \
+        }                                                                                    \
+    } while (0)
+
+/* Every added entry points at its own byte here, so entries are told apart by address */
+static char arena[MAX_INPUT];
+
+struct model
+{
+    const char *buffptr[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    size_t size[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    int count;
+    unsigned long added;
+};
+
+static void model_add(struct model *model, const char *buffptr, size_t size)
+{
+    if (model->count == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        memmove(&model->buffptr[0], &model->buffptr[1], (model->count - 1) * sizeof(model->buffptr[0]));
+        memmove(&model->size[0], &model->size[1], (model->count - 1) * sizeof(model->size[0]));
+        model->count--;
+    }
+    model->buffptr[model->count] = buffptr;
+    model->size[model->count] = size;
+    model->count++;
+    model->added++;
+}
+
+/**
+ * @return the index in @param model of the entry holding byte @param offset
+ * of the concatenated entries, or -1 past the end.
+ */
+static int model_find(const struct model *model, size_t offset, size_t *entry_offset)
+{
+    for (int i = 0; i < model->count; i++)
+    {
+        if (offset < model->size[i])
+        {
+            *entry_offset = offset;
+            return i;
+        }
+        offset -= model->size[i];
+    }
+    return -1;
+}
+
+static void check_indices(const struct aesd_circular_buffer *buffer, const struct model *model)
+{
+    CHECK(buffer->in_offs < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    CHECK(buffer->out_offs < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    CHECK(buffer->in_offs == model->added % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    CHECK(buffer->full == (model->count == AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED));
+    if (!buffer->full)
+    {
+        CHECK(buffer->out_offs == 0);
+    }
+    else
+    {
+        CHECK(buffer->out_offs == buffer->in_offs);
+    }
+}
+
+static void run_input(const uint8_t *data, size_t size)
+{
+    struct aesd_circular_buffer buffer;
+    struct model model;
+
+    aesd_circular_buffer_init(&buffer);
+    memset(&model, 0, sizeof(model));
+
+    for (size_t i = 0; i < size && model.added < sizeof(arena); i++)
+    {
+        if (data[i] < 0x80)
+        {
+            if (i + 1 >= size)
+            {
+                break;
+            }
+            struct aesd_buffer_entry entry = { &arena[model.added], data[++i] };
+            aesd_circular_buffer_add_entry(&buffer, &entry);
+            model_add(&model, entry.buffptr, entry.size);
+            check_indices(&buffer, &model);
+        }
+        else
+        {
+            if (i + 2 >= size)
+            {
+                break;
+            }
+            size_t offset = (size_t)data[i + 1] << 8 | data[i + 2];
+            i += 2;
+
+            size_t expected_offset = 0, entry_offset = (size_t)-1;
+            int expected = model_find(&model, offset, &expected_offset);
+            struct aesd_buffer_entry *entry =
+                aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry_offset);
+            if (expected == -1)
+            {
+                CHECK(entry == NULL);
+            }
+            else
+            {
+                CHECK(entry != NULL);
+                CHECK(entry->buffptr == model.buffptr[expected]);
+                CHECK(entry->size == model.size[expected]);
+                CHECK(entry_offset == expected_offset);
+            }
+        }
+    }
+}
+
+#ifdef CIRCULAR_BUFFER_LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    run_input(data, size);
+    return 0;
+}
+#else
+static void run_stream(FILE *file)
+{
+    static uint8_t input[MAX_INPUT];
+    size_t size = fread(input, 1, sizeof(input), file);
+    run_input(input, size);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1 && strncmp(argv[1], "-runs=", strlen("-runs=")) == 0)
+    {
+        unsigned long runs = strtoul(argv[1] + strlen("-runs="), NULL, 10);
+        uint8_t input[RANDOM_INPUT_MAX];
+        srand(argc > 2 ? strtoul(argv[2], NULL, 10) : 1);
+        for (unsigned long run = 0; run < runs; run++)
+        {
+            size_t size = rand() % (RANDOM_INPUT_MAX + 1);
+            for (size_t i = 0; i < size; i++)
+            {
+                /* Small offsets, so lookups mostly land inside the stored bytes */
+                input[i] = i % 3 == 1 ? 0 : rand();
+            }
+            run_input(input, size);
+        }
+        return EXIT_SUCCESS;
+    }
+    if (argc == 1)
+    {
+        run_stream(stdin);
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL)
+        {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        run_stream(file);
+        fclose(file);
+    }
+    return EXIT_SUCCESS;
+}
+#endif